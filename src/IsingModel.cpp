@@ -14,7 +14,12 @@
 // Constructors/destructors implemented simply
 // (because of number of options)
 IsingModel::IsingModel() {};
-IsingModel::~IsingModel() {};
+IsingModel::~IsingModel() {
+    clearReplicas();
+    clearRenormalization();
+    if(latticeMap) munmap(latticeMap,latticeMapSize);
+    stopThreads();
+};
 
 
 /* (void) setNumThreads
@@ -22,7 +27,7 @@ IsingModel::~IsingModel() {};
  *  I | (int) number of threads
  */
 void IsingModel::setNumThreads(const int num) {
-    if(nThreads < 1) return;
+    if(num < 1) return;
     nThreads = num;
     hasBeenSetup=false;
 }
@@ -55,10 +60,58 @@ void IsingModel::setLatticeDepth(const int num) {
  */
 void IsingModel::setInteractionSigma(const double sig) {
     interactionSigma=sig;
+    clearReplicas();
+    clearRenormalization();
+
+    // The lattice does not depend on sigma: only refresh the couplings
+    if(hasBeenSetup) {
+        computeCouplings();
+        if(bitPackedSpins) buildBondMasks();
+        recomputeObservables();
+    }
+}
+
+
+/* (void) setInteractionRange
+ *    | Set which pairs of spins interact.
+ *  I | (char*) range to use:
+ *    |         - NEAREST   = lattice nearest neighbors
+ *    |         - CUTOFF    = all pairs closer than the cutoff radius 
+ *    |                       (see setCutoffRadius), coupling |r_i-r_j|^sigma
+ *    |         - LONGRANGE = all pairs, coupling |r_i-r_j|^sigma, summed
+ *    |                       over the cell tree (see setOpeningAngle).
+ *    |                       Use sigma < 0 for decaying couplings
+ */
+void IsingModel::setInteractionRange(char* const rng) {
+    interactionRange=rng;
+    hasBeenSetup=false;
+}
+
+
+/* (void) setCutoffRadius
+ *    | Largest distance between interacting spins for CUTOFF interactions
+ *  I | (double) cutoff radius (>0), in units of the lattice edge
+ */
+void IsingModel::setCutoffRadius(const double rc) {
+    if(rc <= 0) return;
+    cutoffRadius=rc;
     hasBeenSetup=false;
 }
 
 
+/* (void) setOpeningAngle
+ *    | Accuracy of the LONGRANGE sums: a cell of the lattice is replaced
+ *    | by its total spin and dipole moment when its diameter is below
+ *    | theta times its distance. 0 sums all pairs exactly
+ *  I | (double) opening angle theta (>=0)
+ */
+void IsingModel::setOpeningAngle(const double theta) {
+    if(theta < 0) return;
+    openingAngle=theta;
+    if(hasBeenSetup && longRange) recomputeObservables();
+}
+
+
 /* (void) setHausdorffDimension
  *    | Set the lattice Hausdorff dimension.
  *  I | (double) dimension to use 
@@ -85,8 +138,11 @@ void IsingModel::setHausdorffMethod(char* const hmtd) {
 /* (void) setMCMethod 
  *    | Set the MC method.
  *  I | (double) method to use:
- *    |         - METROPOLIS (no multithread) 
- *    |         - HEATBATH   (multithread)
+ *    |         - METROPOLIS    (multithread, see colorStep) 
+ *    |         - HEATBATH      (multithread, see colorStep)
+ *    |         - HYBRID        (no multithread)
+ *    |         - SWENDSEN_WANG (multithread, cluster updates)
+ *    |         - WOLFF         (no multithread, single cluster updates)
  */
 void IsingModel::setMCMethod(char* const mcmd) {
     mcMethod=mcmd;
@@ -94,26 +150,120 @@ void IsingModel::setMCMethod(char* const mcmd) {
 }
 
 
+/* (void) setLatticeStorage
+ *    | Set how the lattice geometry is kept in memory.
+ *  I | (char*) storage to use:
+ *    |         - EXPLICIT = site coordinates and neighbor table 
+ *    |         - IMPLICIT = spins only, neighbors computed from the
+ *    |                      site positions along each axis
+ */
+void IsingModel::setLatticeStorage(char* const stor) {
+    latticeStorage=stor;
+    hasBeenSetup=false;
+}
+
+
+/* (void) setSpinStorage
+ *    | Set how the spins are kept in memory.
+ *  I | (char*) storage to use:
+ *    |         - BYTE      = one signed byte per spin
+ *    |         - BITPACKED = one bit per spin, 64 spins per word
+ */
+void IsingModel::setSpinStorage(char* const stor) {
+    spinStorage=stor;
+    hasBeenSetup=false;
+}
+
+
+/* (void) setLatticeCache
+ *    | Directory in which to keep lattice geometries between runs
+ *  I | (char*) directory to use, or "" to always build the lattice
+ */
+void IsingModel::setLatticeCache(char* const dir) {
+    latticeCacheDir=dir;
+    hasBeenSetup=false;
+}
+
+
 /* (void) setCouplingConsts
  *    | Set the values of H,J in the hamiltonian 
+ *    | (no new setup needed, K and h enter per spin)
  *  I | (double) value of H, magnetic field coupling 
  *    | (double) value of J, neighbor couplings
  */
 void IsingModel::setCouplingConsts(const double tH, const double tJ) {
     H=tH;
     J=tJ;
-    hasBeenSetup=false;
 }
 
 
 /* (void) setTemperature
  *    | Set the temperature of the system
+ *    | (no new setup needed, K and h enter per spin)
  *  I | (double) value of k_B * T (>0) to use 
  */
 void IsingModel::setTemperature(const double tkbT) {
     if (tkbT < 0) return;
     kbT=tkbT;
-    hasBeenSetup=false;
+}
+
+
+/* (void) setTemperatureLadder
+ *    | Set the temperatures of the replicas in runParallelTempering.
+ *    | The replicas start again from the current spins
+ *  I | (vector<double>) values of k_B * T (>0), best in increasing order
+ */
+void IsingModel::setTemperatureLadder(const std::vector<double>& temps) {
+    for(size_t k=0; k < temps.size(); k++) {
+        if(temps[k] <= 0) {
+            std::cout<<"ERROR: Ladder temperatures must be positive"<<std::endl;
+            exit(EXIT_FAILURE); 
+        }
+    }
+    ladderkbT=temps;
+    clearReplicas();
+}
+
+
+/* (void) setSwapInterval
+ *    | How many MC steps to perform between replica swaps in
+ *    | runParallelTempering
+ *  I | (int) number of steps
+ */
+void IsingModel::setSwapInterval(const int num) {
+    if(num < 1) return;
+    swapInterval=num;
+}
+
+
+/* (void) setWangLandauPrecision
+ *    | Final modification factor ln f of runWangLandau
+ *  I | (double) ln f (>0)
+ */
+void IsingModel::setWangLandauPrecision(const double lnf) {
+    if(lnf <= 0) return;
+    wangLandauPrecision=lnf;
+}
+
+
+/* (void) setWangLandauBins
+ *    | Number of bond sum bins of runWangLandau. Uniform couplings 
+ *    | (sigma = 0) always get one bin per bond sum
+ *  I | (int) number of bins
+ */
+void IsingModel::setWangLandauBins(const int num) {
+    if(num < 1) return;
+    wangLandauBins=num;
+}
+
+
+/* (void) setWangLandauMagnetization
+ *    | Whether runWangLandau resolves the magnetization as well as the
+ *    | bond sum, which is needed for H != 0
+ *  I | (bool) resolve the magnetization
+ */
+void IsingModel::setWangLandauMagnetization(const bool mag) {
+    wangLandauMagnetization=mag;
 }
 
 
@@ -121,9 +271,9 @@ void IsingModel::setTemperature(const double tkbT) {
  *    | Returns an array of the spins (+1,-1, or 0)
  */
 const std::vector<int> IsingModel::getSpinArray() {
-    std::vector<int> spins(0);
-    for(const auto &it : spinArray) {
-        spins.push_back(it.active ? it.S : 0);
+    std::vector<int> spins(nSpins);
+    for(int i=0; i<nSpins; i++) {
+        spins[i] = isActive(i) ? getSpin(i) : 0;
     }
     return spins;
 }
@@ -138,34 +288,117 @@ const std::vector<int> IsingModel::getLatticeDimensions() {
 }
 
 
+/* (vector<int>) getComponentSizes 
+ *    | Returns the number of spins in each connected component, see
+ *    | buildComponents
+ */
+const std::vector<int> IsingModel::getComponentSizes() {
+    std::vector<int> sizes;
+    for(int c=0; c < getNumComponents(); c++) 
+        sizes.push_back(componentOffsets[c+1]-componentOffsets[c]);
+    return sizes;
+}
+
+
+/* (vector<int>) getComponentSpins 
+ *    | Returns the indices of the spins in a connected component, in 
+ *    | increasing order
+ *  I | (int) index of the component
+ */
+const std::vector<int> IsingModel::getComponentSpins(const int c) {
+    if(c < 0 || c >= getNumComponents()) {
+        std::cout<<"ERROR: No connected component "<<c<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+    return std::vector<int>(componentSpins.begin()+componentOffsets[c],
+                            componentSpins.begin()+componentOffsets[c+1]);
+}
+
+
 /* (int) getMagnetization() 
- *    | Returns the magnetization of the lattice 
+ *    | Returns the magnetization of the lattice, kept up to date
+ *    | on every spin flip
  */
 const int IsingModel::getMagnetization() {
-    int mag=0;
-    for(const auto &it : spinArray) {
-       mag += it.S*it.active;
+    return magnetization;
+}
+
+
+/* (void) recomputeObservables
+ *    | Recompute the running magnetization and bond sum from the spins.
+ *    | Used after bulk changes to the spins, and to validate the 
+ *    | incremental updates
+ */
+void IsingModel::recomputeObservables() {
+    if(bitPackedSpins && !bondMasks.empty()) {
+        countBitPackedSpins();
+        return;
+    }
+
+    if(longRange) computeMultipoles();
+
+    int    mag=0;
+    double bonds=0;
+    for(int i=0; i<nSpins; i++) {
+        if (!isActive(i)) continue;
+        int si=getSpin(i);
+        mag += si;
+
+        // Each bond is seen from both ends. Long-range bonds are summed
+        // over all pairs, as the cell tree only approximates them
+        if(longRange) bonds += si*(bitPackedSpins ? getPairSum<0,true >(i)
+                                                  : getPairSum<0,false>(i));
+        else          bonds += si*(bitPackedSpins ? getNeighborSum<0,true >(i)
+                                                  : getNeighborSum<0,false>(i));
     }
     magnetization=mag;
-    return mag;
+    bondSum=bonds/2;
 }
 
 
 /* (int) getDistanceSq() 
  *    | Returns the square of the distance between two spins
- *  I | (spin) first spin
- *    | (spin) second spin
- *  O | (double) distance between the spins, or 1 if distance=0
+ *  I | (int) index of first spin
+ *    | (int) index of second spin
+ *  O | (double) squared distance between the spins
+ */
+double IsingModel::getDistanceSq(const int s1, const int s2) {
+    int p=latticeStrides.size();
+    int L=latticeAxisPos.size();
+    double distance=0;
+    for(int j=0; j < p; j++) {
+        double dx = latticeAxisPos[(s1/latticeStrides[j])%L]
+                   -latticeAxisPos[(s2/latticeStrides[j])%L];
+        distance += dx*dx;
+    }
+    return distance;
+}
+
+
+/* (void) forEachNeighbor
+ *    | Call f(j, coupling) for every nearest neighbor j of spin i, from the
+ *    | neighbor table or, for an implicit lattice, from the position r of
+ *    | spin i along each axis
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *  I | (int) index of the spin
+ *    | (function) f(int j, double coupling)
  */
-double IsingModel::getDistanceSq(spin s1, spin s2) {
-    if(interactionSigma==0) return 1;
-    else {
-        double distance=0;
-        for(int i=0; i < s1.coords.size(); i++) {
-            distance += pow(s1.coords.at(i)-s2.coords.at(i),2);
+template<int P, typename F>
+inline void IsingModel::forEachNeighbor(const int i, F f) {
+    if(!implicitLattice) {
+        for(int e=nbrOffsets[i]; e < nbrOffsets[i+1]; e++) {
+            f(nbrIndices[e],nbrCouplings[e]);
         }
-        if(distance==0) return 1;
-        return distance;
+        return;
+    }
+
+    const int  p=(P > 0 ? P : latticeStrides.size());
+    const int  L=latticeAxisPos.size();
+    const int* strides=latticeStrides.data();
+    for(int j=0; j < p; j++) {
+        int r=(i/strides[j])%L;
+        if(r > 0)   f(i-strides[j],axisCouplings[r-1]);
+        if(r < L-1) f(i+strides[j],axisCouplings[r]  );
     }
 }
 
@@ -182,270 +415,1906 @@ const double IsingModel::getEffHamiltonian(const int flip) {
 
 
 /* (double) getEffHamiltonian 
- *    | Get the effective energy of the system state, -(beta*Hamiltonian) (no multithread)
+ *    | Get the effective energy of the system state, -(beta*Hamiltonian) (no multithread).
+ *    | For the current state this comes from the running magnetization and 
+ *    | bond sum; with flips the whole lattice is summed
  *  I | (vector<int> (default: empty)) array of spin indices to flip 
  */
 const double IsingModel::getEffHamiltonian(const std::vector<int>& flips) {
+    if(flips.empty()) return -geth()*magnetization - getK()*bondSum;
+
+    // Mark the flipped spins once rather than searching per neighbor
+    std::vector<int> spinFlip(nSpins,1);
+    for(size_t i=0; i<flips.size(); i++) spinFlip.at(flips.at(i))=-1;
+
     double energy=0;
     for(int i=0; i<nSpins; i++) {
-        spin s=spinArray.at(i);
-        if (!s.active) continue;
-        int spinFlip=
-            (std::find(flips.begin(),flips.end(),i)!=flips.end() ? -1 : 1);
+        if (!isActive(i)) continue;
+        int si=getSpin(i)*spinFlip[i];
+
+        energy -= geth()*si;
+
+        // Long-range couplings are summed over all pairs j > i exactly
+        if(longRange) {
+            for(int j=i+1; j<nSpins; j++) {
+                if (!isActive(j)) continue;
+                double distance=getDistanceSq(i,j);
+                double coupling=(interactionSigma==0) ? 1 
+                                : pow(distance,interactionSigma/2);
+                energy -= getK()*coupling*si*getSpin(j)*spinFlip[j];
+            }
+            continue;
+        }
 
-        energy -= geth()*s.S*spinFlip;
+        // Nearest neighbor sum, each bond is seen from both ends
+        double neighborSum=0;
+        forEachNeighbor<0>(i,[&](const int j, const double coupling) {
+            neighborSum += coupling*getSpin(j)*spinFlip[j];
+        });
+        energy -= getK()*si*neighborSum/2;
+    }
+    return energy;
+}
 
 
-        // Nearest neighbor sum, no circular boundary conditions
-        for(int j=0,p=latticeDimensions.size(); j < p; j++) {
-            double indexPM = pow(latticeDimensions.at(j),p-1-j);
-            
-            // get to the left
-            if(i > indexPM-1 && s.coords.at(j) != xmin 
-               && spinArray.at(i-indexPM).coords.at(j) != xmax) {
-                int newIndex=i-indexPM;
+/* (double) getDeltaEffH
+ *    | Get the change in the effective energy if a single spin were flipped.
+ *    | Only the spin's nearest neighbors and its field term enter, so this
+ *    | is O(p) rather than the O(N) of getEffHamiltonian(flip)
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *    | (bool) whether the spins are bit-packed
+ *  I | (int) index of the spin to flip
+ */
+template<int P, bool BITS>
+inline double IsingModel::getDeltaEffH(const int i) {
+    if (!isActive(i)) return 0;
 
-                if(spinArray.at(newIndex).active) {
+    // Flipping S_i -> -S_i changes -h*S_i - K*S_i*sum by twice its value
+    return 2*spinAt<BITS>(i)*(geth() + getK()*getNeighborSum<P,BITS>(i));
+}
 
-                    int tspinFlip=
-                        (std::find(flips.begin(),flips.end(),newIndex)!=flips.end() ? -1 : 1); 
-    
-                    energy -= getK()*pow(getDistanceSq(s,spinArray.at(newIndex)),interactionSigma/2)
-                              *s.S*spinArray.at(newIndex).S*spinFlip*tspinFlip/2;
 
-                }
-            } 
-
-            // get to the right
-            if(i + indexPM < nSpins && s.coords.at(j) != xmax 
-               && spinArray.at(i+indexPM).coords.at(j) != xmin) {
-                int newIndex=i+indexPM;
-                
-                if(spinArray.at(newIndex).active) {
-            
-                    int tspinFlip=
-                        (std::find(flips.begin(),flips.end(),newIndex)!=flips.end() ? -1 : 1); 
-    
-                    energy -= getK()*pow(getDistanceSq(s,spinArray.at(newIndex)),interactionSigma/2)
-                              *s.S*spinArray.at(newIndex).S*spinFlip*tspinFlip/2;
+/* (double) getNeighborSum
+ *    | Get the coupling-weighted sum of the spins interacting with spin i
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *    | (bool) whether the spins are bit-packed
+ *  I | (int) index of the spin
+ */
+template<int P, bool BITS>
+inline double IsingModel::getNeighborSum(const int i) {
+    if(longRange) return getLongRangeSum<P,BITS>(i);
+
+    double neighborSum=0;
+    forEachNeighbor<P>(i,[&](const int j, const double coupling) {
+        neighborSum += coupling*spinAt<BITS>(j);
+    });
+    return neighborSum;
+}
 
-                }
-            }
 
-        }
+/* (void) updateSpin
+ *    | Propose a flip of spin i, accept it with the Metropolis or heat bath
+ *    | probability and tally the change of the observables
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *    | (bool) whether the spins are bit-packed
+ *    | (bool) heat bath (true) or Metropolis (false) acceptance
+ *  I | (int) index of the spin
+ *    | (double) h and K
+ *    | (double*) acceptance table, see updateAcceptanceTables, or 0
+ *    | (TRandom3*) pointer to random number generator
+ *    | (sweepTally) running change of the observables
+ */
+template<int P, bool BITS, bool HEATBATH>
+inline void IsingModel::updateSpin(const int i, const double h, const double K,
+        const double* table, TRandom3* rNG, sweepTally& tally) {
+    int    si = spinAt<BITS>(i);
+    double neighborSum = getNeighborSum<P,BITS>(i);
+    double dE = 2*si*(h + K*neighborSum);
+    bool spinFlip=false;
+
+    if(HEATBATH) {
+        // P(flip) = e^-dE / (1 + e^-dE); exp overflow gives 0 as required
+        double acceptance = table ? table[(si > 0 ? 2*maxNeighbors+1 : 0) + int(neighborSum)]
+                                  : 1/(1+exp(dE));
+        spinFlip = (rNG->Uniform() < acceptance);
+    } 
+    else if(dE<0) spinFlip = true;
+    else if(table) spinFlip = (rNG->Uniform() < table[(si > 0 ? 2*maxNeighbors+1 : 0)
+                                                      + int(neighborSum)]);
+    else spinFlip = (rNG->Uniform() < exp(-dE));
+
+    // With an open cell tree the field of spin i is approximate, and the
+    // changes would not add up to the bond sum: sum the pairs instead
+    if(spinFlip) {
+        flipSpin<BITS>(i);
+        tally.dMag   -= 2*si;
+        tally.dBonds -= 2*si*((longRange && openingAngle > 0) ? getPairSum<P,BITS>(i)
+                                                               : neighborSum);
+        tally.info.push_back(fabs(dE));
+        if(longRange) updateMultipoles(i,-2*si);
     }
-    return energy;
 }
 
 
-/* (double) computePartitionFunction 
- *    | Get the partition function of the system (no multithread)
- *  I | (int (default: 0)) index to start the trace at 
- *    | (vector<int> (default: empty)) array of spin indices to flip 
+/* (void) applyTallies
+ *    | Add the changes tallied by each thread during a sweep to the 
+ *    | running observables
  */
-const double IsingModel::computePartitionFunction(const int start, const std::vector<int>& flips) {
-    if(start >= nSpins) return 0;
-    double Z=0;
+void IsingModel::applyTallies() {
+    for(size_t t=0; t < threadTallies.size(); t++) {
+        sweepTally& tally=threadTallies[t];
+        magnetization += tally.dMag;
+        bondSum       += tally.dBonds;
+        mcInfo.insert(mcInfo.end(),tally.info.begin(),tally.info.end());
+        tally.dMag=0;
+        tally.dBonds=0;
+        tally.info.clear();
+    }
+}
 
-    
-    std::vector<int> newflips = flips; 
-    newflips.push_back(start);
 
-    // add e^-BH with S_i = +1 and S_i = -1
-    Z+=exp(getEffHamiltonian(newflips));
+/* (void) countBitPackedSpins
+ *    | Get the magnetization and bond sum of bit-packed spins with uniform 
+ *    | nearest neighbor couplings (sigma = 0), 64 spins at a time. The spins 
+ *    | one step along axis j are the spin bits shifted by its stride, so 
+ *    | XOR marks the anti-aligned bonds and popcount counts them
+ */
+void IsingModel::countBitPackedSpins() {
+    long up=0, antiBonds=0, bonds=0;
+    size_t nWords=spinBits.size();
+    for(size_t w=0; w < nWords; w++) up += __builtin_popcountll(spinBits[w]);
+
+    for(size_t j=0; j < latticeStrides.size(); j++) {
+        const uint64_t* mask=&bondMasks[j*nWords];
+        for(size_t w=0; w < nWords; w++) {
+            uint64_t neighbors=getSpinWord(long(w)*64+latticeStrides[j]);
+            antiBonds += __builtin_popcountll((spinBits[w]^neighbors)&mask[w]);
+            bonds     += __builtin_popcountll(mask[w]);
+        }
+    }
+
+    magnetization=2*up-nSpins;
+    bondSum=bonds-2*antiBonds;
+}
 
-    // branch into computations with history 
-    // S_i = +1 and S_i = -1
-    Z+=computePartitionFunction(start+1,newflips);
-    Z+=computePartitionFunction(start+1,flips);
-    if(start == 0) Z+=exp(getEffHamiltonian());
 
-    return Z; 
+/* (uint64_t) getSpinWord
+ *    | The 64 spin bits starting at an arbitrary bit, zero past the end
+ *  I | (long) index of the first bit
+ */
+inline uint64_t IsingModel::getSpinWord(const long bit) {
+    size_t k=bit>>6;
+    int    o=bit&63;
+    uint64_t lo = k   < spinBits.size() ? spinBits[k]   : 0;
+    uint64_t hi = k+1 < spinBits.size() ? spinBits[k+1] : 0;
+    return o == 0 ? lo : (lo>>o) | (hi<<(64-o));
 }
 
 
-/* (void) nextPermutation
- *    | For a vector of indices and some uniform maximum index,
- *    | get a new tuple of indices from the current state by 
- *    | adding one to the lowest index and "carrying" over.
- *    | Return tvN[0]=-1 when finished, for the loop end condition
- *  I | (std::vector<int>) the array of indices to permute 
- *    | (int) the maximum array index
+/* (void) packSpins
+ *    | Move the spins into the bit-packed array (bit set = spin up)
  */
-void IsingModel::nextPermutation(std::vector<int>& tvN, const int max) {
-    //if(debug) std::cout<<"\tNextPermutation: "<<tvN.size()<<" "<<max<<std::endl;
+void IsingModel::packSpins() {
+    size_t nWords=(nSpins+63)/64;
+    spinBits.assign(nWords,0);
+    for(int i=0; i < nSpins; i++) {
+        if(spinArray[i] > 0) spinBits[i>>6] |= (1ULL<<(i&63));
+    }
+    std::vector<signed char>().swap(spinArray);
+    buildBondMasks();
+}
 
-    for(size_t i=0; i<tvN.size(); i++) {
-        if(i == tvN.size()-1) {
-            if(tvN.at(i) == max-1) tvN.at(0)=-1;
-            else tvN.at(i)+=1;
-            return;
-        } else if(tvN.at(i) == max-1) {
-            tvN.at(i)=0;
-        } else {
-            tvN.at(i)=tvN.at(i)+1;
-            return;
+
+/* (void) buildBondMasks
+ *    | For uniform couplings mark the sites with a neighbor one step up 
+ *    | along each axis for countBitPackedSpins
+ */
+void IsingModel::buildBondMasks() {
+    size_t nWords=(nSpins+63)/64;
+    bondMasks.clear();
+    if(interactionSigma != 0 || !allSpinsActive || interactionRange!="NEAREST") return;
+
+    int p=latticeStrides.size();
+    int L=latticeAxisPos.size();
+    bondMasks.assign(p*nWords,0);
+    for(int j=0; j < p; j++) {
+        for(int i=0; i < nSpins; i++) {
+            if((i/latticeStrides[j])%L < L-1) 
+                bondMasks[j*nWords+(i>>6)] |= (1ULL<<(i&63));
         }
     }
 }
 
 
-/* (void) addSpins 
- *    | Adds spins to the spinArray by isolating each smallest hypercube
- *    | making up the lattice at a given depth 
- *  I | (int) depth to build to
- *    | (double) vector of coordinates to start fractal at
- *    | (double) vector of coordinates to end fractal at
+/* (void) buildNeighborTable
+ *    | Tabulate the nearest neighbors of every spin once, in compressed
+ *    | sparse row form: the neighbors of spin i are 
+ *    | nbrIndices[nbrOffsets[i] ... nbrOffsets[i+1]-1], with the squared
+ *    | length of each bond in nbrDistSq.
+ *    | Rows are counted, then filled, by nThreads workers in parallel
  */
-void IsingModel::addSpins(const int depth,
-        const std::vector<double>& x0, 
-        const std::vector<double>& x1) {
-        
-    if(debug) std::cout<<"\taddSpins:"<<std::endl;
+template<int P>
+void IsingModel::buildNeighborTable() {
+    if(debug) std::cout<<"\tbuildNeighborTable:"<<std::endl;
+
+    const int  p=(P > 0 ? P : latticeStrides.size());
+    const int  L=latticeAxisPos.size();
+    const int* indexPM=latticeStrides.data();
+    const double* axisPos=latticeAxisPos.data();
+
+    // No circular boundary conditions: step along axis j only 
+    // while the site position r_j stays inside [0,L)
+    auto hasLeft =[&](const int i, const int j) {
+        return (i/indexPM[j])%L > 0   && spinActive[i-indexPM[j]];
+    };
+    auto hasRight=[&](const int i, const int j) {
+        return (i/indexPM[j])%L < L-1 && spinActive[i+indexPM[j]];
+    };
+
+    // Count the neighbors of each spin (held in nbrOffsets[i] until
+    // the offsets are known), and of each chunk of spins
+    nbrOffsetsBuf.assign(nSpins+1,0);
+    std::vector<int> chunkBonds(nThreads+1,0);
+    splitAcrossThreads(nSpins,indexPM[0],
+        [&](const int chunk, const int first, const int last) {
+            for(int i=first; i < last; i++) {
+                if (!spinActive[i]) continue;
+                for(int j=0; j < p; j++) 
+                    nbrOffsetsBuf[i] += hasLeft(i,j) + hasRight(i,j);
+                chunkBonds[chunk+1] += nbrOffsetsBuf[i];
+            }
+        });
+    for(int c=0; c < nThreads; c++) chunkBonds[c+1] += chunkBonds[c];
+
+    nbrOffsetsBuf[nSpins]=chunkBonds[nThreads];
+    nbrIndicesBuf.resize(chunkBonds[nThreads]);
+    nbrDistSqBuf.resize(chunkBonds[nThreads]);
+
+    // Each chunk writes its own rows, starting from its offset
+    splitAcrossThreads(nSpins,indexPM[0],
+        [&](const int chunk, const int first, const int last) {
+            int e=chunkBonds[chunk];
+            for(int i=first; i < last; i++) {
+                nbrOffsetsBuf[i]=e;
+                if (!spinActive[i]) continue;
+
+                // Neighbors differ only in their position along axis j
+                for(int j=0; j < p; j++) {
+                    int r=(i/indexPM[j])%L;
+                    if(hasLeft(i,j)) {
+                        nbrIndicesBuf[e]=i-indexPM[j];
+                        nbrDistSqBuf[e] =(axisPos[r]-axisPos[r-1])*(axisPos[r]-axisPos[r-1]);
+                        e++;
+                    }
+                    if(hasRight(i,j)) {
+                        nbrIndicesBuf[e]=i+indexPM[j];
+                        nbrDistSqBuf[e] =(axisPos[r+1]-axisPos[r])*(axisPos[r+1]-axisPos[r]);
+                        e++;
+                    }
+                }
+            }
+        });
+    nbrOffsets=nbrOffsetsBuf.data();
+    nbrIndices=nbrIndicesBuf.data();
+    nbrDistSq =nbrDistSqBuf.data();
+    nBonds    =nbrIndicesBuf.size();
 
-    double delta    = abs(x1.at(0)-x0.at(0));
-    //double sliceLen = hausdorffScale * delta;
-    //double spaceLen = (delta - sliceLen*hausdorffSlices)/(hausdorffSlices-1);
-
-    // Create an array of length dimension, p
-    // Containing arrays of length depth, d
-    // Which will contain our p*d indices 
-    std::vector<int> vN(latticeDimensions.size()*depth);
-
-    // Loop over all valid positions for a spin hypercube
-    for(std::fill(vN.begin(),vN.end(),0); 
-        vN.at(0) != -1; 
-        nextPermutation(vN,hausdorffSlices)) {
-        // Current position is lower corner of hypercube we produce 
-        // (think in terms of the origin for the unit hypercube, [0,1]^p) 
-        std::vector<double> cPos(latticeDimensions.size());
-        for(size_t iDim=0; iDim < latticeDimensions.size(); iDim++) {
-            cPos.at(iDim) += x0.at(iDim);
-            
-            for(int iDepth=0; iDepth < depth; iDepth++) {
-                int depthVal = vN.at(iDim*depth+iDepth);
-                double depthScale = pow(hausdorffScale,depth-iDepth)*delta;
-                cPos.at(iDim) += (1 + (1/hausdorffScale-hausdorffSlices)/(hausdorffSlices-1))
-                                 *depthScale
-                                 *depthVal;
+    if(debug) std::cout<<"\t\t- "<<nBonds/2<<" bonds"<<std::endl;
+}
+
+
+/* (void) buildCutoffTable
+ *    | Tabulate, in the same form as buildNeighborTable, all pairs of spins
+ *    | within the cutoff radius. The spins are sorted into a grid of 
+ *    | buckets at least the cutoff wide along each axis, so the partners
+ *    | of a spin are in its own bucket or an adjacent one: O(N) for a
+ *    | fixed cutoff rather than scanning all pairs
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ */
+template<int P>
+void IsingModel::buildCutoffTable() {
+    if(debug) std::cout<<"\tbuildCutoffTable:"<<std::endl;
+
+    const int  p=(P > 0 ? P : latticeStrides.size());
+    const int  L=latticeAxisPos.size();
+    const int* indexPM=latticeStrides.data();
+    const double cutoffSq=cutoffRadius*cutoffRadius;
+
+    // The sites lie on a grid, so the bucket along an axis only 
+    // depends on the site position r along it
+    const double extent=latticeAxisPos[L-1]-latticeAxisPos[0];
+    const int    G=std::max(1,std::min(L,int(extent/cutoffRadius)));
+    std::vector<int> axisBucket(L);
+    for(int r=0; r < L; r++) {
+        axisBucket[r]=std::min(G-1,int((latticeAxisPos[r]-latticeAxisPos[0])*G/extent));
+    }
+    std::vector<int> bucketStrides(p,1);
+    for(int j=p-2; j >= 0; j--) bucketStrides[j]=bucketStrides[j+1]*G;
+    const int nBuckets=bucketStrides[0]*G;
+    auto bucketOf=[&](const int i) {
+        int b=0;
+        for(int j=0; j < p; j++) b += axisBucket[(i/indexPM[j])%L]*bucketStrides[j];
+        return b;
+    };
+
+    // Counting sort of the active spins into buckets
+    std::vector<int> bucketOffsets(nBuckets+1,0);
+    std::vector<int> bucketSpins;
+    for(int i=0; i < nSpins; i++) {
+        if(spinActive[i]) bucketOffsets[bucketOf(i)+1]++;
+    }
+    for(int b=0; b < nBuckets; b++) bucketOffsets[b+1] += bucketOffsets[b];
+    bucketSpins.resize(bucketOffsets[nBuckets]);
+    {
+        std::vector<int> fill(bucketOffsets.begin(),bucketOffsets.end()-1);
+        for(int i=0; i < nSpins; i++) {
+            if(spinActive[i]) bucketSpins[fill[bucketOf(i)]++]=i;
+        }
+    }
+
+    // Call f(j, distance^2) for every partner j of spin i in the 3^p 
+    // buckets around its own
+    int nAdjacent=pow(3,p);
+    auto forEachPartner=[&](const int i, const std::function<void(int,double)>& f) {
+        const double* xi=&spinCoords[i*p];
+        int home=bucketOf(i);
+        for(int t=0; t < nAdjacent; t++) {
+            int  b=0;
+            bool inside=true;
+            for(int j=p-1, u=t; j >= 0; j--, u/=3) {
+                int bj=(home/bucketStrides[j])%G + u%3-1;
+                inside = inside && bj >= 0 && bj < G;
+                b += bj*bucketStrides[j];
+            }
+            if(!inside) continue;
+
+            for(int e=bucketOffsets[b]; e < bucketOffsets[b+1]; e++) {
+                int k=bucketSpins[e];
+                if(k == i) continue;
+                const double* xk=&spinCoords[k*p];
+                double distance=0;
+                for(int j=0; j < p; j++) distance += (xi[j]-xk[j])*(xi[j]-xk[j]);
+                if(distance <= cutoffSq) f(k,distance);
             }
         }
+    };
+
+    // Count, then fill, each chunk's rows as in buildNeighborTable
+    nbrOffsetsBuf.assign(nSpins+1,0);
+    std::vector<int> chunkBonds(nThreads+1,0);
+    splitAcrossThreads(nSpins,indexPM[0],
+        [&](const int chunk, const int first, const int last) {
+            for(int i=first; i < last; i++) {
+                if (!spinActive[i]) continue;
+                forEachPartner(i,[&](const int k, const double distance) {
+                    nbrOffsetsBuf[i]++;
+                });
+                chunkBonds[chunk+1] += nbrOffsetsBuf[i];
+            }
+        });
+    for(int c=0; c < nThreads; c++) chunkBonds[c+1] += chunkBonds[c];
+
+    nbrOffsetsBuf[nSpins]=chunkBonds[nThreads];
+    nbrIndicesBuf.resize(chunkBonds[nThreads]);
+    nbrDistSqBuf.resize(chunkBonds[nThreads]);
+
+    splitAcrossThreads(nSpins,indexPM[0],
+        [&](const int chunk, const int first, const int last) {
+            int e=chunkBonds[chunk];
+            for(int i=first; i < last; i++) {
+                nbrOffsetsBuf[i]=e;
+                if (!spinActive[i]) continue;
+                forEachPartner(i,[&](const int k, const double distance) {
+                    nbrIndicesBuf[e]=k;
+                    nbrDistSqBuf[e] =distance;
+                    e++;
+                });
+            }
+        });
+    nbrOffsets=nbrOffsetsBuf.data();
+    nbrIndices=nbrIndicesBuf.data();
+    nbrDistSq =nbrDistSqBuf.data();
+    nBonds    =nbrIndicesBuf.size();
+
+    if(debug) std::cout<<"\t\t- "<<nBuckets<<" buckets, "<<nBonds/2<<" bonds"<<std::endl;
+}
+
+
+/* (void) computeCouplings
+ *    | Fill nbrCouplings with the distance coupling |r_i-r_j|^sigma of 
+ *    | each bond in the neighbor table. An implicit lattice only needs the
+ *    | coupling between neighboring positions along one axis.
+ *    | The couplings leave out K = J/kbT, which the kernels apply once per
+ *    | spin, so they only change with sigma
+ */
+void IsingModel::computeCouplings() {
+    if(implicitLattice) {
+        axisCouplings.resize(latticeAxisPos.size()-1);
+        for(size_t r=0; r < axisCouplings.size(); r++) {
+            double distance=latticeAxisPos[r+1]-latticeAxisPos[r];
+            axisCouplings[r] = (interactionSigma==0 || distance==0) ? 1 
+                               : pow(distance*distance,interactionSigma/2);
+        }
+        return;
+    }
 
-        // - place spins at each corner of a hypercube
-        // - cube will have side length s^d and bottom corner at cPos
-        // - loop will go through e.g. for p=2 (0,0) , (0,1) , (1,0) , (1,1)
-        std::vector<int> cubePoints(latticeDimensions.size());
-        for(std::fill(cubePoints.begin(),cubePoints.end(),0);
-            cubePoints.at(0) != -1;
-            nextPermutation(cubePoints,2)) {
-           
-            spin ts;
-            ts.active=1;
-            ts.S=1;
-            ts.coords=std::vector<double>(latticeDimensions.size());
-            for(size_t index=0; index < cubePoints.size(); index++) {
-                ts.coords.at(index) = cubePoints.at(index) * pow(hausdorffScale,depth)*delta
-                                        + cPos.at(index);
+    nbrCouplingsBuf.resize(nBonds);
+    nbrCouplings=nbrCouplingsBuf.data();
+    splitAcrossThreads(nBonds,1,
+        [&](const int chunk, const int first, const int last) {
+            for(int e=first; e < last; e++) {
+                nbrCouplingsBuf[e] = (interactionSigma==0 || nbrDistSq[e]==0) ? 1 
+                                  : pow(nbrDistSq[e],interactionSigma/2);
             }
+        });
+}
 
 
-            spinArray.push_back(ts);
-            nSpins++;
-        } 
+/* (void) buildCellTree
+ *    | Prepare the cell tree for LONGRANGE couplings. It follows the
+ *    | self-similar structure of the lattice: a level k cell spans 
+ *    | cellWidth[k] = 2n^(d-k) positions along each axis, so it holds n^p
+ *    | level k+1 cells, down to cells of 2^p sites at level d and single 
+ *    | sites at level d+1. Along an axis the cells of a level are blocks
+ *    | of positions, with centers in cellAxisCenter
+ */
+void IsingModel::buildCellTree() {
+    const int L=latticeAxisPos.size();
+    const int p=latticeStrides.size();
+    const int n=hausdorffSlices;
+
+    cellWidth.assign(1,L);
+    while(cellWidth.back() > 2) cellWidth.push_back(cellWidth.back()/n);
+    cellWidth.push_back(1);
+
+    // Cell and center offsets of each level, excluding the sites
+    const int nLevels=cellWidth.size()-1;
+    cellOffsets.assign(nLevels+1,0);
+    cellAxisOffsets.assign(nLevels+1,0);
+    cellDiameterSq.assign(nLevels,0);
+    for(int k=0; k < nLevels; k++) {
+        int blocks=L/cellWidth[k];
+        cellOffsets[k+1]     = cellOffsets[k]     + int(pow(blocks,p));
+        cellAxisOffsets[k+1] = cellAxisOffsets[k] + blocks;
+    }
+
+    cellAxisCenter.resize(cellAxisOffsets[nLevels]);
+    for(int k=0; k < nLevels; k++) {
+        int width=cellWidth[k];
+        for(int a=0; a < L/width; a++) {
+            double lo=latticeAxisPos[a*width], hi=latticeAxisPos[a*width+width-1];
+            cellAxisCenter[cellAxisOffsets[k]+a] = (lo+hi)/2;
+            cellDiameterSq[k] = std::max(cellDiameterSq[k],p*(hi-lo)*(hi-lo));
+        }
     }
 
-    if(debug) std::cout<<"\t\t- spinArray made, sorting..."<<std::endl;
-    QuickSort(spinArray,0,nSpins-1);
+    cellCharge.assign(cellOffsets[nLevels],0);
+    cellDipole.assign(cellOffsets[nLevels]*size_t(p),0);
 
+    if(debug) std::cout<<"\t\t- cell tree: "<<nLevels<<" levels, "
+                       <<cellOffsets[nLevels]<<" cells"<<std::endl;
 }
 
 
-/* (void) setup 
- *    | Prepare the class object for simulation 
+/* (void) computeMultipoles
+ *    | Sum the spins of every cell of the cell tree into its total spin
+ *    | and its dipole moment about the cell center
  */
-void IsingModel::setup() {
-    if(debug) std::cout<<"\tSETUP:"<<std::endl;
-    
-    // Calculate the lattice dimensions from the input
-    // Hausdorff dimension
-    // (See my notes for derivation)
-    if(hausdorffMethod=="SCALING") {
-        hausdorffScale=exp(-ceil(hausdorffDim)*log(hausdorffSlices)/hausdorffDim);
+void IsingModel::computeMultipoles() {
+    std::fill(cellCharge.begin(),cellCharge.end(),0);
+    std::fill(cellDipole.begin(),cellDipole.end(),0);
+    for(int i=0; i < nSpins; i++) {
+        if(isActive(i)) updateMultipoles(i,getSpin(i));
     }
+}
 
-    // Check that the dimensions are reasonable
-    if(hausdorffScale > 1/hausdorffSlices) {
-        std::cout<<"ERROR: Invalid Hausdorff scaling"<<std::endl;
-        exit(EXIT_FAILURE); 
-    }
 
-    // Keep track of the number of site coordinates along each axis
-    for(int i=0; i<ceil(hausdorffDim); i++) {
-        latticeDimensions.push_back(2*pow(hausdorffSlices,latticeDepth));
+/* (void) updateMultipoles
+ *    | Add a change of spin i to the cells containing it, O(p*depth)
+ *  I | (int) index of the spin
+ *    | (int) change of the spin
+ */
+void IsingModel::updateMultipoles(const int i, const int dS) {
+    const int L=latticeAxisPos.size();
+    const int p=latticeStrides.size();
+    const int nLevels=cellOffsets.size()-1;
+
+    for(int k=0; k < nLevels; k++) {
+        int blocks=L/cellWidth[k];
+        int cell=0;
+        for(int j=0; j < p; j++) {
+            int r=(i/latticeStrides[j])%L;
+            cell = cell*blocks + r/cellWidth[k];
+        }
+        cellCharge[cellOffsets[k]+cell] += dS;
+
+        double* dipole=&cellDipole[size_t(cellOffsets[k]+cell)*p];
+        for(int j=0; j < p; j++) {
+            int r=(i/latticeStrides[j])%L;
+            dipole[j] += dS*(latticeAxisPos[r]
+                            -cellAxisCenter[cellAxisOffsets[k]+r/cellWidth[k]]);
+        }
     }
+}
 
-    // Generate the lattice array
-    std::vector<double> x0;
-    std::vector<double> x1;
-    for(size_t i=0; i<latticeDimensions.size(); i++) {
-        x0.push_back(0);
-        x1.push_back(1);
+
+/* (double) getLongRangeSum
+ *    | Get the sum of |r_i-r_j|^sigma S_j over all other spins j by a 
+ *    | walk of the cell tree from the top. Cells far from spin i compared
+ *    | to their size (see setOpeningAngle) enter through their multipole
+ *    | expansion
+ *    |   Q|R|^sigma - sigma |R|^(sigma-2) R.D 
+ *    | with R from the cell center to spin i, Q the total spin and D the
+ *    | dipole moment; other cells are opened. This is O(log N) per spin 
+ *    | for a fixed opening angle
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *    | (bool) whether the spins are bit-packed
+ *  I | (int) index of the spin
+ */
+template<int P, bool BITS>
+double IsingModel::getLongRangeSum(const int i) {
+    const int p=(P > 0 ? P : latticeStrides.size());
+    const int L=latticeAxisPos.size();
+
+    int    r[32];
+    double x[32];
+    for(int j=0; j < p; j++) {
+        r[j]=(i/latticeStrides[j])%L;
+        x[j]=latticeAxisPos[r[j]];
     }
+    return getCellSum<P,BITS>(i,r,x,0,0);
+}
 
-    addSpins(latticeDepth,x0,x1);
 
-    hasBeenSetup=true;
+/* (double) getPairSum
+ *    | Get the sum of |r_i-r_j|^sigma S_j over all other spins j exactly,
+ *    | O(N). Keeps the running bond sum exact where getLongRangeSum 
+ *    | approximates
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *    | (bool) whether the spins are bit-packed
+ *  I | (int) index of the spin
+ */
+template<int P, bool BITS>
+double IsingModel::getPairSum(const int i) {
+    const double sigma=interactionSigma;
+    double sum=0;
+    for(int j=0; j < nSpins; j++) {
+        if(j == i || !isActive(j)) continue;
+        double coupling = (sigma==0) ? 1 : pow(getDistanceSq(i,j),sigma/2);
+        sum += coupling*spinAt<BITS>(j);
+    }
+    return sum;
 }
 
 
-/* (void) runMonteCarlo 
- *    | Run the Monte Carlo simulation (spin-flipping) 
+/* (double) getCellSum
+ *    | Contribution of the children of one cell to getLongRangeSum
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *    | (bool) whether the spins are bit-packed
+ *  I | (int) index of the spin
+ *    | (int*) positions of the spin along each axis
+ *    | (double*) coordinates of the spin
+ *    | (int) level of the cell
+ *    | (int) index of the cell in its level
  */
-void IsingModel::runMonteCarlo() {
-    if(debug) std::cout<<"\tRunMonteCarlo:"<<std::endl;
-    if(!hasBeenSetup) {
-        std::cout<<"ERROR: Object has not been setup!"<<std::endl;
-        exit(EXIT_FAILURE); 
+template<int P, bool BITS>
+double IsingModel::getCellSum(const int i, const int* r, const double* x,
+                              const int k, const int cell) {
+    const int p=(P > 0 ? P : latticeStrides.size());
+    const int L=latticeAxisPos.size();
+    const int nLevels=cellOffsets.size()-1;
+    const int blocks=L/cellWidth[k];
+    const int childBlocks=L/cellWidth[k+1];
+    const int branch=cellWidth[k]/cellWidth[k+1];
+    const double theta2=openingAngle*openingAngle;
+    const double sigma=interactionSigma;
+
+    int a[32];
+    for(int j=p-1, c=cell; j >= 0; j--, c/=blocks) a[j]=c%blocks;
+
+    double sum=0;
+    int nChildren=pow(branch,p);
+    for(int t=0; t < nChildren; t++) {
+        // Axis blocks of child t, and whether it holds spin i
+        int  child=0;
+        bool holdsSpin=true;
+        double dist2=0;
+        int  b[32];
+        for(int j=p-1, u=t; j >= 0; j--, u/=branch) b[j]=a[j]*branch + u%branch;
+        for(int j=0; j < p; j++) {
+            child = child*childBlocks + b[j];
+            holdsSpin = holdsSpin && (b[j] == r[j]/cellWidth[k+1]);
+        }
+
+        // Single sites
+        if(k+1 == nLevels) {
+            if(child == i || !isActive(child)) continue;
+            for(int j=0; j < p; j++) {
+                double dx=x[j]-latticeAxisPos[b[j]];
+                dist2 += dx*dx;
+            }
+            double coupling = (sigma==0) ? 1 : pow(dist2,sigma/2);
+            sum += coupling*spinAt<BITS>(child);
+            continue;
+        }
+
+        // Far cells through their multipoles, near ones are opened
+        const double* center=&cellAxisCenter[cellAxisOffsets[k+1]];
+        double R[32];
+        for(int j=0; j < p; j++) {
+            R[j]=x[j]-center[b[j]];
+            dist2 += R[j]*R[j];
+        }
+        if(!holdsSpin && (sigma == 0 || cellDiameterSq[k+1] < theta2*dist2)) {
+            int index=cellOffsets[k+1]+child;
+            const double* dipole=&cellDipole[size_t(index)*p];
+            double RD=0;
+            for(int j=0; j < p; j++) RD += R[j]*dipole[j];
+            double coupling = (sigma==0) ? 1 : pow(dist2,sigma/2);
+            sum += cellCharge[index]*coupling - sigma*coupling/dist2*RD;
+        } else {
+            sum += getCellSum<P,BITS>(i,r,x,k+1,child);
+        }
     }
-    
-    // Various utils 
-    TRandom3* rNG = new TRandom3(); 
+    return sum;
+}
 
-    currentEffH=getEffHamiltonian();
-    double avgAbsDeltaE=-1;
-    int nSpinsPerThread = floor(nSpins/nThreads);
-    int cNumThreads=nThreads;
-    //std::vector<boost::thread*> threads;
 
-    // Start performing MC steps
-    for(int i=0; i < nMCSteps; i++) {
-        if(debug && nMCSteps < 100) std::cout<<"\t\t At MC Step "
-                                             <<i<<"/"<<nMCSteps<<std::endl;
 
 
-        double newAvgAbsDeltaE=0;
-        for(int iDE=0,lMCI=mcInfo.size(); iDE < lMCI; iDE++)
-             newAvgAbsDeltaE+=(mcInfo.at(iDE));
-        mcInfo.clear();
 
-        //std::cout<<" - "<<newAvgAbsDeltaE<<" "<<avgAbsDeltaE<<std::endl;
+/* (double) computePartitionFunction 
+ *    | Get the partition function of the system, see 
+ *    | computeLogPartitionFunction
+ */
+const double IsingModel::computePartitionFunction() {
+    return exp(computeLogPartitionFunction());
+}
 
-             if(mcMethod=="METROPOLIS") metropolisStep(rNG);
-        else if(mcMethod=="HEATBATH")   heatBathStep(rNG);
-        else if(mcMethod=="HYBRID") {
-            
-            // Prepare threads
-            //int currentNThreads=0;
 
-            // Create a vector of spin indices
-            int popVectorSize=nSpins;
-            std::vector<int> popVector(nSpins);
-            for(int j=0; j < nSpins; j++) popVector.at(j)=j;
+/* (int) getEnumerationBonds
+ *    | Bonds between the active spins for exact enumeration, by position
+ *    | a in the list of active spins: the bonds of a are 
+ *    | [offsets[a], offsets[a+1]) in neighbors and couplings. LONGRANGE
+ *    | couplings are listed for all pairs
+ *  I | (vector<int>&, vector<int>&, vector<double>&) bond table (output)
+ *    | (int) connected component to list, or -1 for all active spins
+ *  O | (int) number of spins listed
+ */
+int IsingModel::getEnumerationBonds(std::vector<int>& offsets, std::vector<int>& neighbors,
+                                    std::vector<double>& couplings, const int component) {
+    std::vector<int> active;
+    if(component >= 0) {
+        active.assign(componentSpins.begin()+componentOffsets[component],
+                      componentSpins.begin()+componentOffsets[component+1]);
+    } else {
+        for(int i=0; i < nSpins; i++) if (isActive(i)) active.push_back(i);
+    }
+    const int n=active.size();
+    auto slot=[&](const int j) {
+        std::vector<int>::iterator it=std::lower_bound(active.begin(),active.end(),j);
+        return (it == active.end() || *it != j) ? -1 : int(it-active.begin());
+    };
+
+    offsets.assign(1,0);
+    neighbors.clear();
+    couplings.clear();
+    for(int a=0; a < n; a++) {
+        auto addBond=[&](const int j, const double coupling) {
+            int b=slot(j);
+            if(b < 0) return;
+            neighbors.push_back(b);
+            couplings.push_back(coupling);
+        };
+        if(longRange) {
+            for(int b=0; b < n; b++) {
+                double distanceSq=getDistanceSq(active[a],active[b]);
+                if(b != a) addBond(active[b], (interactionSigma==0 || distanceSq==0) ? 1 
+                                              : pow(distanceSq,interactionSigma/2));
+            }
+        } else {
+            forEachNeighbor<0>(active[a],addBond);
+        }
+        offsets.push_back(neighbors.size());
+    }
+    return n;
+}
 
-            if(nSpinsPerThread < 1) nSpinsPerThread=1;
-            // Based upon the previous running average of Delta E,
-            // choose whether to increase the number of threads
-                                        
+
+/* (void) getComponentClasses
+ *    | Group the connected components that are copies of each other: 
+ *    | the same bond table (see getEnumerationBonds) with the spins in 
+ *    | index order, as for translated copies of a cell. Such components
+ *    | have the same partition function
+ *  I | (vector<int>&) first component of each class (output)
+ *    | (vector<int>&) number of components in each class (output)
+ */
+void IsingModel::getComponentClasses(std::vector<int>& classes, std::vector<int>& multiplicity) {
+    classes.clear();
+    multiplicity.clear();
+
+    std::map<std::vector<double>,int> seen;
+    std::vector<int   > offsets;
+    std::vector<int   > neighbors;
+    std::vector<double> couplings;
+    for(int c=0; c < getNumComponents(); c++) {
+        getEnumerationBonds(offsets,neighbors,couplings,c);
+        std::vector<double> key(offsets.begin(),offsets.end());
+        key.insert(key.end(),neighbors.begin(),neighbors.end());
+        key.insert(key.end(),couplings.begin(),couplings.end());
+
+        std::map<std::vector<double>,int>::iterator it=seen.find(key);
+        if(it == seen.end()) {
+            seen[key]=classes.size();
+            classes.push_back(c);
+            multiplicity.push_back(1);
+        } else {
+            multiplicity[it->second]++;
+        }
+    }
+}
+
+
+/* (double) computeLogPartitionFunction
+ *    | Exact ln Z by enumeration, see enumerateLogPartitionFunction. The
+ *    | spins of different connected components do not interact, so Z is 
+ *    | the product of the Z of the components, and components that are 
+ *    | copies of each other are only enumerated once
+ */
+const double IsingModel::computeLogPartitionFunction() {
+    if(!hasBeenSetup) {
+        std::cout<<"ERROR: Object has not been setup!"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+
+    std::vector<int> classes;
+    std::vector<int> multiplicity;
+    getComponentClasses(classes,multiplicity);
+
+    double logZ=0;
+    std::vector<int   > offsets;
+    std::vector<int   > neighbors;
+    std::vector<double> couplings;
+    for(size_t k=0; k < classes.size(); k++) {
+        getEnumerationBonds(offsets,neighbors,couplings,classes[k]);
+        logZ += multiplicity[k]*enumerateLogPartitionFunction(offsets,neighbors,couplings);
+    }
+    return logZ;
+}
+
+
+/* (double) enumerateLogPartitionFunction
+ *    | Exact ln Z of a set of spins, summing exp(-beta H) over its 2^n 
+ *    | states in Gray code order: each state differs from the one 
+ *    | before by a single flip, so its energy follows from one neighbor
+ *    | sum. The states are split across the threads by the values of the
+ *    | last spins (the prefix), and each thread sums the terms relative
+ *    | to the largest one it has seen, so ln Z stays finite at any 
+ *    | temperature. LONGRANGE couplings are summed over all pairs
+ *  I | (vector<int>&, vector<int>&, vector<double>&) bond table, see
+ *    | getEnumerationBonds
+ *  O | (double) ln Z
+ */
+double IsingModel::enumerateLogPartitionFunction(const std::vector<int>& offsets,
+                                                 const std::vector<int>& neighbors,
+                                                 const std::vector<double>& couplings) {
+    const int n=offsets.size()-1;
+    if(n > 62) {
+        std::cout<<"ERROR: Exact enumeration needs at most 62 spins"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+    double upBonds=0;
+    for(size_t e=0; e < couplings.size(); e++) upBonds += couplings[e]/2;
+
+    // With uniform couplings the neighbor sum f is an integer in [-z,z],
+    // and the weight of the next state is the last one times one of the
+    // factors exp(-dE) for S_a, f at [z+f] (S_a=-1) and [3z+1+f] (S_a=+1).
+    // Otherwise each weight takes an exp()
+    const double h=geth();
+    const double K=getK();
+    const bool   uniform=(interactionSigma==0);
+    int z=0;
+    for(int a=0; a < n; a++) z=std::max(z,offsets[a+1]-offsets[a]);
+    std::vector<double> factors;
+    for(int si=-1; si <= 1; si+=2) {
+        for(int f=-z; f <= z; f++) factors.push_back(exp(-2*si*(h + K*f)));
+    }
+
+    int nPrefix=0;
+    while(nPrefix < n && (1L<<nPrefix) < 4L*nThreads) nPrefix++;
+    const int nLow=n-nPrefix;
+
+    std::vector<double> chunkRef(nThreads,-INFINITY);
+    std::vector<double> chunkSum(nThreads,0);
+    splitAcrossThreads(1<<nPrefix,1,
+        [&](const int chunk, const int first, const int last) {
+            std::vector<signed char> spins(n);
+            double effH;
+            double weight=0;      // exp(-effH-ref)
+            double ref=-INFINITY;
+            double sum=0;
+            auto flip=[&](const int a) {
+                double f=0;
+                for(int e=offsets[a]; e < offsets[a+1]; e++) f += couplings[e]*spins[neighbors[e]];
+                effH  += 2*spins[a]*(h + K*f);
+                weight = uniform ? weight*factors[(spins[a] > 0 ? 3*z+1 : z) + int(f)] 
+                                 : exp(-effH-ref);
+                spins[a] = -spins[a];
+            };
+            auto add=[&]() {
+                if(-effH > ref) {
+                    sum    = sum*exp(ref+effH) + 1;
+                    ref    = -effH;
+                    weight = 1;
+                } else {
+                    sum += weight;
+                }
+            };
+
+            // Start each prefix from all spins up. The running weight is
+            // recomputed now and then against rounding
+            for(int prefix=first; prefix < last; prefix++) {
+                spins.assign(n,1);
+                effH = -h*n - K*upBonds;
+                for(int b=0; b < nPrefix; b++) if((prefix>>b)&1) flip(nLow+b);
+                weight=exp(-effH-ref);
+                add();
+                for(long t=1; t < (1L<<nLow); t++) {
+                    flip(__builtin_ctzl(t));
+                    if((t&0xffff) == 0) weight=exp(-effH-ref);
+                    add();
+                }
+            }
+            chunkRef[chunk]=ref;
+            chunkSum[chunk]=sum;
+        });
+
+    double ref=*std::max_element(chunkRef.begin(),chunkRef.end());
+    double sum=0;
+    for(int c=0; c < nThreads; c++) {
+        if(chunkSum[c] > 0) sum += chunkSum[c]*exp(chunkRef[c]-ref);
+    }
+    return ref+log(sum);
+}
+
+
+/* (double) computeEliminationLogPartitionFunction
+ *    | Exact ln Z and its moments by variable elimination, see 
+ *    | eliminateLogPartitionFunction. As in computeLogPartitionFunction,
+ *    | each class of identical connected components is summed out once
+ *  I | (double*) <E>, specific heat, <M>, susceptibility (output, or 0)
+ *  O | (double) ln Z
+ */
+const double IsingModel::computeEliminationLogPartitionFunction(double* meanE, double* heat,
+                                                                double* meanM, double* chi) {
+    if(!hasBeenSetup) {
+        std::cout<<"ERROR: Object has not been setup!"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+
+    std::vector<int> classes;
+    std::vector<int> multiplicity;
+    getComponentClasses(classes,multiplicity);
+
+    double logZ=0;
+    double total[4]={0,0,0,0};
+    std::vector<int   > offsets;
+    std::vector<int   > neighbors;
+    std::vector<double> couplings;
+    for(size_t k=0; k < classes.size(); k++) {
+        double derivatives[4];
+        getEnumerationBonds(offsets,neighbors,couplings,classes[k]);
+        logZ += multiplicity[k]*eliminateLogPartitionFunction(offsets,neighbors,couplings,derivatives);
+        for(int d=0; d < 4; d++) total[d] += multiplicity[k]*derivatives[d];
+    }
+    if(meanE) *meanE = -total[0];
+    if(heat ) *heat  =  total[1]/(kbT*kbT);
+    if(meanM) *meanM =  total[2];
+    if(chi  ) *chi   =  total[3]/kbT;
+    return logZ;
+}
+
+
+/* (double) eliminateLogPartitionFunction
+ *    | Exact ln Z of a set of spins by variable elimination, for sets far
+ *    | beyond the reach of enumerateLogPartitionFunction. The spins are 
+ *    | summed out one at a time, in lattice or min-fill order; summing 
+ *    | out S_v leaves a table over its neighbors that are still in the 
+ *    | graph (its scope), so the cost grows as 2^width with the largest 
+ *    | scope rather than 2^n. Along with ln Z each table entry carries 
+ *    | the first and second derivatives in beta and h, which gives the
+ *    | moments exactly. Spins whose tables do not depend on each other 
+ *    | (branches of the elimination tree) are summed out on separate 
+ *    | threads. The last spins of the set can be kept: they are summed 
+ *    | over only at the end, after the ln of the partial sum at each of
+ *    | their states is stored (see renormalizeCouplings)
+ *  I | (vector<int>&, vector<int>&, vector<double>&) bond table, see
+ *    | getEnumerationBonds
+ *    | (double*) d/dbeta, d2/dbeta2, d/dh, d2/dh2 of ln Z (output)
+ *    | (int) number of spins to keep
+ *    | (vector<double>*) ln of the partial sum at each state of the kept
+ *    | spins, bit x for S = +1 of the x-th kept spin (output, or 0)
+ *  O | (double) ln Z
+ */
+double IsingModel::eliminateLogPartitionFunction(const std::vector<int>& offsets,
+                                                 const std::vector<int>& neighbors,
+                                                 const std::vector<double>& couplings,
+                                                 double* derivatives, const int nKept,
+                                                 std::vector<double>* keptTable) {
+    const int n    =offsets.size()-1;
+    const int nFree=n-nKept;
+
+    // Elimination order, whichever of two is cheaper (sum of the table
+    // sizes): the lattice order, which sweeps a front of spins across 
+    // the lattice, or greedy min-fill, which takes the spin whose 
+    // neighbors need the fewest new bonds among themselves, then the
+    // fewest neighbors. Only spins within two bonds of the last one 
+    // can change their fill
+    std::vector<std::vector<int> > bonded(n);
+    for(int a=0; a < n; a++) {
+        bonded[a].assign(neighbors.begin()+offsets[a],neighbors.begin()+offsets[a+1]);
+        std::sort(bonded[a].begin(),bonded[a].end());
+        bonded[a].erase(std::unique(bonded[a].begin(),bonded[a].end()),bonded[a].end());
+    }
+    std::vector<int> order;
+    std::vector<int> position;
+    std::vector<std::vector<int> > scopes;
+    auto findOrder=[&](const bool minFill) {
+        std::vector<std::vector<int> > graph=bonded;
+        auto countFill=[&](const int v) {
+            long fill=0;
+            const std::vector<int>& adj=graph[v];
+            for(size_t x=0; x < adj.size(); x++) {
+                for(size_t y=x+1; y < adj.size(); y++) {
+                    if(!std::binary_search(graph[adj[x]].begin(),graph[adj[x]].end(),adj[y])) fill++;
+                }
+            }
+            return fill;
+        };
+        std::vector<long> fill(n,0);
+        if(minFill) for(int a=0; a < nFree; a++) fill[a]=countFill(a);
+
+        // Kept spins come after all the others
+        order.clear();
+        position.assign(n,-1);
+        for(int a=nFree; a < n; a++) position[a]=a;
+        scopes.assign(n,std::vector<int>());
+        double cost=0;
+        for(int step=0; step < nFree; step++) {
+            int v = minFill ? -1 : step;
+            for(int a=0; a < nFree && minFill; a++) {
+                if(position[a] >= 0) continue;
+                if(v < 0 || fill[a] < fill[v] 
+                        || (fill[a] == fill[v] && graph[a].size() < graph[v].size())) v=a;
+            }
+            order.push_back(v);
+            position[v]=step;
+            scopes[v]=graph[v];
+            cost += pow(2.,scopes[v].size());
+
+            std::vector<int> touched;
+            for(size_t x=0; x < scopes[v].size(); x++) {
+                std::vector<int>& adj=graph[scopes[v][x]];
+                std::vector<int> merged;
+                std::set_union(adj.begin(),adj.end(),scopes[v].begin(),scopes[v].end(),
+                               std::back_inserter(merged));
+                merged.erase(std::remove(merged.begin(),merged.end(),v),merged.end());
+                merged.erase(std::remove(merged.begin(),merged.end(),scopes[v][x]),merged.end());
+                adj.swap(merged);
+                touched.insert(touched.end(),adj.begin(),adj.end());
+                touched.push_back(scopes[v][x]);
+            }
+            graph[v].clear();
+            if(!minFill) continue;
+            std::sort(touched.begin(),touched.end());
+            touched.erase(std::unique(touched.begin(),touched.end()),touched.end());
+            for(size_t x=0; x < touched.size(); x++) {
+                if(position[touched[x]] < 0) fill[touched[x]]=countFill(touched[x]);
+            }
+        }
+        return cost;
+    };
+    const bool minFill = findOrder(true) < findOrder(false);
+    if(minFill) findOrder(true);
+    int width=0;
+    for(int a=0; a < nFree; a++) width=std::max(width,int(scopes[a].size()));
+    if(width > maxEliminationWidth) {
+        std::cout<<"ERROR: Variable elimination needs tables over more than "
+                 <<maxEliminationWidth<<" spins"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+
+    // Elimination tree: the table of S_v is summed into the first spin of
+    // its scope to go. A spin is ready once all of its children are, so
+    // the spins of one level can be summed out in parallel. Spins with 
+    // only kept spins in their scope are the roots
+    std::vector<std::vector<int> > children(n);
+    std::vector<int> roots;
+    std::vector<int> level(n,0);
+    int nLevels=0;
+    for(int step=0; step < nFree; step++) {
+        int v=order[step];
+        nLevels=std::max(nLevels,level[v]+1);
+        int parent=-1;
+        for(size_t x=0; x < scopes[v].size(); x++) {
+            if(parent < 0 || position[scopes[v][x]] < position[parent]) parent=scopes[v][x];
+        }
+        if(parent < 0 || parent >= nFree) {
+            roots.push_back(v);
+            continue;
+        }
+        children[parent].push_back(v);
+        level[parent]=std::max(level[parent],level[v]+1);
+    }
+    std::vector<std::vector<int> > levels(nLevels);
+    for(int a=0; a < nFree; a++) levels[level[a]].push_back(a);
+    if(debug) std::cout<<"\t\t- "<<(minFill ? "min-fill" : "lattice")<<" order, width "
+                       <<width<<", "<<nLevels<<" levels"<<std::endl;
+
+    // Table entries: ln, d/dbeta, d2/dbeta2, d/dh, d2/dh2 of the partial
+    // sum. Bit x of the entry index is S = +1 for the x-th spin of the 
+    // scope. The neighbor sum of S_v and the entries of its children 
+    // are looked up by the low and high halves of the index separately
+    const double h=geth();
+    const double K=getK();
+    std::vector<std::vector<double> > tables(n);
+    auto sumOut=[&](const int v, const int first, const int last) {
+        const std::vector<int>& scope=scopes[v];
+        const int nLow=scope.size()/2;
+        const int lowMask=(1<<nLow)-1;
+        auto bitOf=[&](const int spin) {
+            return int(std::lower_bound(scope.begin(),scope.end(),spin)-scope.begin());
+        };
+        std::vector<double> lowField(1<<nLow,0), highField(1<<(scope.size()-nLow),0);
+        for(int e=offsets[v]; e < offsets[v+1]; e++) {
+            if(position[neighbors[e]] < position[v]) continue;
+            const int x=bitOf(neighbors[e]);
+            std::vector<double>& field = x < nLow ? lowField : highField;
+            const int bit = x < nLow ? x : x-nLow;
+            for(size_t m=0; m < field.size(); m++) field[m] += couplings[e]*(((m>>bit)&1) ? 1 : -1);
+        }
+        const int nChildren=children[v].size();
+        std::vector<std::vector<int> > lowChild(nChildren), highChild(nChildren);
+        std::vector<int> childBitV(nChildren,0);
+        for(int c=0; c < nChildren; c++) {
+            const std::vector<int>& childScope=scopes[children[v][c]];
+            lowChild [c].assign(lowField .size(),0);
+            highChild[c].assign(highField.size(),0);
+            for(size_t y=0; y < childScope.size(); y++) {
+                if(childScope[y] == v) {
+                    childBitV[c]=1<<y;
+                    continue;
+                }
+                const int x=bitOf(childScope[y]);
+                std::vector<int>& index = x < nLow ? lowChild[c] : highChild[c];
+                const int bit = x < nLow ? x : x-nLow;
+                for(size_t m=0; m < index.size(); m++) index[m] |= ((m>>bit)&1)<<y;
+            }
+        }
+
+        for(int m=first; m < last; m++) {
+            const double f=lowField[m&lowMask] + highField[m>>nLow];
+            double entry[2][5];
+            for(int sv=0; sv < 2; sv++) {
+                const int s=2*sv-1;
+                double* L=entry[sv];
+                L[0]=s*(h + K*f);
+                L[1]=s*(H + J*f);
+                L[2]=0;
+                L[3]=s;
+                L[4]=0;
+                for(int c=0; c < nChildren; c++) {
+                    int index = lowChild[c][m&lowMask] | highChild[c][m>>nLow] 
+                              | (sv ? childBitV[c] : 0);
+                    const double* childL=&tables[children[v][c]][5*index];
+                    for(int k=0; k < 5; k++) L[k] += childL[k];
+                }
+            }
+
+            // ln(e^L0 + e^L1), and the variance of the derivatives over 
+            // the two terms for the second derivatives
+            double ref=std::max(entry[0][0],entry[1][0]);
+            double p0=exp(entry[0][0]-ref);
+            double p1=exp(entry[1][0]-ref);
+            double* L=&tables[v][5*m];
+            L[0]=ref+log(p0+p1);
+            p0/=(p0+p1);
+            p1=1-p0;
+            for(int k=1; k < 5; k+=2) {
+                double diff=entry[1][k]-entry[0][k];
+                L[k  ]=p0*entry[0][k  ] + p1*entry[1][k  ];
+                L[k+1]=p0*entry[0][k+1] + p1*entry[1][k+1] + p0*p1*diff*diff;
+            }
+        }
+    };
+
+    for(int l=0; l < nLevels; l++) {
+        const std::vector<int>& spins=levels[l];
+        for(size_t x=0; x < spins.size(); x++) tables[spins[x]].resize(5L<<scopes[spins[x]].size());
+        if(int(spins.size()) >= nThreads) {
+            splitAcrossThreads(spins.size(),1,
+                [&](const int chunk, const int first, const int last) {
+                    for(int x=first; x < last; x++) sumOut(spins[x],0,1<<scopes[spins[x]].size());
+                });
+        } else {
+            for(size_t x=0; x < spins.size(); x++) {
+                splitAcrossThreads(1<<scopes[spins[x]].size(),64,
+                    [&](const int chunk, const int first, const int last) {
+                        sumOut(spins[x],first,last);
+                    });
+            }
+        }
+        for(size_t x=0; x < spins.size(); x++) {
+            for(size_t c=0; c < children[spins[x]].size(); c++) {
+                std::vector<double>().swap(tables[children[spins[x]][c]]);
+            }
+        }
+    }
+
+    // The tables of the roots and the terms of the kept spins among 
+    // themselves give the partial sum at each state of the kept spins
+    const int nStates=1<<nKept;
+    std::vector<double> states(5L*nStates,0);
+    for(int k=0; k < nStates; k++) {
+        double* L=&states[5*k];
+        for(int x=0; x < nKept; x++) {
+            const int a=nFree+x;
+            const int s=((k>>x)&1) ? 1 : -1;
+            double f=0;
+            for(int e=offsets[a]; e < offsets[a+1]; e++) {
+                if(neighbors[e] > a) f += couplings[e]*(((k>>(neighbors[e]-nFree))&1) ? 1 : -1);
+            }
+            L[0] += s*(h + K*f);
+            L[1] += s*(H + J*f);
+            L[3] += s;
+        }
+        for(size_t r=0; r < roots.size(); r++) {
+            const std::vector<int>& scope=scopes[roots[r]];
+            int index=0;
+            for(size_t x=0; x < scope.size(); x++) index |= ((k>>(scope[x]-nFree))&1)<<x;
+            for(int d=0; d < 5; d++) L[d] += tables[roots[r]][5*index+d];
+        }
+    }
+    if(keptTable) {
+        keptTable->resize(nStates);
+        for(int k=0; k < nStates; k++) (*keptTable)[k]=states[5*k];
+    }
+    if(nStates == 1) {
+        for(int d=0; d < 4; d++) derivatives[d]=states[d+1];
+        return states[0];
+    }
+
+    // Sum over the kept spins as over the two states of a spin above
+    double ref=-INFINITY;
+    for(int k=0; k < nStates; k++) ref=std::max(ref,states[5*k]);
+    double sum=0;
+    for(int k=0; k < nStates; k++) sum += exp(states[5*k]-ref);
+    for(int d=0; d < 4; d++) derivatives[d]=0;
+    for(int k=0; k < nStates; k++) {
+        double p=exp(states[5*k]-ref)/sum;
+        for(int d=0; d < 4; d+=2) {
+            derivatives[d  ] += p*states[5*k+d+1];
+            derivatives[d+1] += p*(states[5*k+d+2] + states[5*k+d+1]*states[5*k+d+1]);
+        }
+    }
+    for(int d=0; d < 4; d+=2) derivatives[d+1] -= derivatives[d]*derivatives[d];
+    return ref+log(sum);
+}
+
+
+/* (void) buildRenormalizationBlock
+ *    | The chain that renormalizeCouplings decimates: the L=2n spins of
+ *    | the depth-1 lattice of the same geometry along its last axis from
+ *    | the origin, with the bonds among them as in getEnumerationBonds 
+ *    | but with the two end spins of the chain listed last. A bond 
+ *    | inside a hypercube (from an even position to the next one) is 
+ *    | scaled by K, any other bond by the gap coupling. Also counts the 
+ *    | chains of the block that are moved onto each edge of the coarse
+ *    | hypercube, n^(p-1) for a full block
+ */
+void IsingModel::buildRenormalizationBlock() {
+    if(rgBlock) return;
+    if(longRange) {
+        std::cout<<"ERROR: Renormalization needs NEAREST or CUTOFF interactions"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+
+    rgBlock=new IsingModel();
+    rgBlock->latticeDepth    =1;
+    rgBlock->interactionSigma=interactionSigma;
+    rgBlock->hausdorffDim    =hausdorffDim;
+    rgBlock->hausdorffSlices =hausdorffSlices;
+    rgBlock->hausdorffScale  =hausdorffScale;
+    rgBlock->hausdorffMethod =hausdorffMethod;
+    rgBlock->latticeStorage  =latticeStorage;
+    rgBlock->interactionRange=interactionRange;
+    rgBlock->cutoffRadius    =cutoffRadius;
+    rgBlock->setup();
+
+    // The first L spins in row-major order are the chain, and with all 
+    // of them active they are also the first L in the bond table
+    const int L=rgBlock->latticeDimensions.at(0);
+    for(int r=0; r < L; r++) {
+        if (!rgBlock->isActive(r)) {
+            std::cout<<"ERROR: Renormalization needs all spins along the block edge"<<std::endl;
+            exit(EXIT_FAILURE); 
+        }
+    }
+    std::vector<int   > offsets;
+    std::vector<int   > neighbors;
+    std::vector<double> couplings;
+    const int n=rgBlock->getEnumerationBonds(offsets,neighbors,couplings);
+    rgChainsPerEdge=double(n)/(L<<(rgBlock->latticeStrides.size()-1));
+
+    auto slot=[&](const int r) {return (r == 0) ? L-2 : (r == L-1) ? L-1 : r-1;};
+    auto position=[&](const int a) {return (a == L-2) ? 0 : (a == L-1) ? L-1 : a+1;};
+    rgOffsets.assign(1,0);
+    rgNeighbors.clear();
+    rgCouplings.clear();
+    rgGapBonds.clear();
+    for(int a=0; a < L; a++) {
+        const int r=position(a);
+        for(int e=offsets[r]; e < offsets[r+1]; e++) {
+            const int t=neighbors[e];
+            if(t >= L) continue;
+            rgNeighbors.push_back(slot(t));
+            rgCouplings.push_back(couplings[e]);
+            rgGapBonds .push_back(!(std::min(r,t)%2 == 0 && abs(r-t) == 1));
+        }
+        rgOffsets.push_back(rgNeighbors.size());
+    }
+
+    // Gap bonds this strong are rigid to double precision
+    double weakest=INFINITY;
+    for(size_t e=0; e < rgCouplings.size(); e++)
+        if(rgGapBonds[e]) weakest=std::min(weakest,rgCouplings[e]);
+    rgRigidGap=40/weakest;
+
+    if(debug) std::cout<<"\t\t- renormalization chain of "<<L<<" spins, "
+                       <<rgChainsPerEdge<<" chains per edge"<<std::endl;
+}
+
+
+/* (void) clearRenormalization
+ *    | Forget the block and the decimations, after the geometry or the 
+ *    | couplings change
+ */
+void IsingModel::clearRenormalization() {
+    delete rgBlock;
+    rgBlock=0;
+    rgOffsets.clear();
+    rgNeighbors.clear();
+    rgCouplings.clear();
+    rgGapBonds.clear();
+    rgTable.clear();
+    rgFixedPointKnown=false;
+    rgCriticalKnown  =false;
+}
+
+
+/* (void) renormalizeCouplings
+ *    | One decimation step of the real-space renormalization group, in 
+ *    | the Migdal-Kadanoff form. The lattice is built from copies of the
+ *    | depth-1 block, so keeping only the 2^p corners of each block 
+ *    | leaves the lattice one level shallower. Along each axis, the bonds
+ *    | across the other axes are first moved onto the chains of 2n spins
+ *    | through the corners, so each chain carries the couplings and 
+ *    | fields of m = n^(p-1) chains. The chain is then summed out exactly
+ *    | to its ends (see eliminateLogPartitionFunction), and the ln of the
+ *    | weights of the four end states projected on S_0, S_1 and S_0 S_1.
+ *    | The bonds between blocks are moved in the same way, onto the gaps
+ *    | of the coarse lattice, but not decimated, and so are followed as a
+ *    | coupling of their own: in one dimension the step is exact. 
+ *    | Couplings are those of the finest level of the block, so both are
+ *    | rescaled by s^-sigma to the finest level of the next block. Steps 
+ *    | are remembered, so flows and the searches for the fixed point and
+ *    | T_c reuse them
+ *  I | (double) K inside the hypercubes, K across the gaps and h 
+ *    | (double*) the same after the decimation (output)
+ */
+void IsingModel::renormalizeCouplings(const double tK, const double tKGap, const double th,
+                                      double* K1, double* KGap1, double* h1) {
+    if(!hasBeenSetup) {
+        std::cout<<"ERROR: Object has not been setup!"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+    buildRenormalizationBlock();
+
+    std::vector<double> key={tK,tKGap,th};
+    std::map<std::vector<double>,std::vector<double> >::iterator it=rgTable.find(key);
+    if(it != rgTable.end()) {
+        *K1   =it->second[0];
+        *KGap1=it->second[1];
+        *h1   =it->second[2];
+        return;
+    }
+
+    // The chain computes with its own H, J and kbT
+    std::vector<double> couplings(rgCouplings.size());
+    for(size_t e=0; e < couplings.size(); e++)
+        couplings[e]=rgChainsPerEdge*rgCouplings[e]*(rgGapBonds[e] ? tKGap : tK);
+    rgBlock->kbT=1;
+    rgBlock->H  =rgChainsPerEdge*th;
+    rgBlock->J  =1;
+    double derivatives[4];
+    std::vector<double> logWeight;
+    rgBlock->eliminateLogPartitionFunction(rgOffsets,rgNeighbors,couplings,derivatives,
+                                           2,&logWeight);
+
+    const double rescale=pow(hausdorffScale,-interactionSigma);
+    *h1   =(logWeight[3]-logWeight[0])/4;
+    *K1   =(logWeight[3]+logWeight[0]-logWeight[1]-logWeight[2])/4*rescale;
+    *KGap1=rgChainsPerEdge*tKGap*rescale;
+    rgTable[key]={*K1,*KGap1,*h1};
+}
+
+
+/* (void) getRenormalizationFlow
+ *    | Follow the couplings through repeated decimations, see 
+ *    | renormalizeCouplings, starting from the same K inside the 
+ *    | hypercubes and across the gaps
+ *  I | (double) K and h to start from
+ *    | (int) number of decimations
+ *    | (vector<double>*) K, K across the gaps and h after 0 ... nSteps
+ *    |                   decimations (output)
+ */
+void IsingModel::getRenormalizationFlow(const double tK, const double th, const int nSteps,
+                                        std::vector<double>* flowK,
+                                        std::vector<double>* flowKGap,
+                                        std::vector<double>* flowh) {
+    flowK   ->assign(1,tK);
+    flowKGap->assign(1,tK);
+    flowh   ->assign(1,th);
+    double K   =tK;
+    double KGap=tK;
+    double h   =th;
+    for(int step=0; step < nSteps; step++) {
+        renormalizeCouplings(K,KGap,h,&K,&KGap,&h);
+        flowK   ->push_back(K);
+        flowKGap->push_back(KGap);
+        flowh   ->push_back(h);
+    }
+}
+
+
+/* (double) getRenormalizationFixedPoint
+ *    | The critical fixed point K* = K'(K*) at h=0. When the moved gap 
+ *    | bonds grow, m s^-sigma > 1, every flow ends with rigid gaps and 
+ *    | K* is found for those: K is scanned upwards for K' - K to turn 
+ *    | positive, then bisected. Otherwise the blocks decouple at large 
+ *    | scales and there is no finite fixed point
+ *  O | (double) K* in units of the block, or NAN 
+ */
+const double IsingModel::getRenormalizationFixedPoint() {
+    if(rgFixedPointKnown) return rgFixedPoint;
+    buildRenormalizationBlock();
+
+    rgFixedPoint=NAN;
+    rgFixedPointKnown=true;
+    if(rgChainsPerEdge*pow(hausdorffScale,-interactionSigma) <= 1) return rgFixedPoint;
+
+    auto growth=[&](const double K) {
+        double K1, KGap1, h1;
+        renormalizeCouplings(K,rgRigidGap,0,&K1,&KGap1,&h1);
+        return K1-K;
+    };
+    double lo=1e-3;
+    double hi=NAN;
+    for(double K=2*lo; K < 1e2; K*=2) {
+        if(growth(K) > 0) {
+            hi=K;
+            break;
+        }
+        lo=K;
+    }
+    if(!std::isnan(hi)) {
+        for(int iter=0; iter < 50; iter++) {
+            double mid=(lo+hi)/2;
+            if(growth(mid) > 0) hi=mid;
+            else                lo=mid;
+        }
+        rgFixedPoint=(lo+hi)/2;
+    }
+    return rgFixedPoint;
+}
+
+
+/* (double) getRenormalizationCriticalTemperature
+ *    | k_B T_c with the current J: the K to start the flow from (see 
+ *    | getRenormalizationFlow) that parts the flows to the disordered 
+ *    | (K -> 0) and ordered (K -> infinity) phases, bisected. The block 
+ *    | has the couplings of the finest level at depth 1; at the depth of
+ *    | this lattice they are s^((d-1) sigma) times larger
+ *  O | (double) k_B T_c, or NAN without a fixed point
+ */
+const double IsingModel::getRenormalizationCriticalTemperature() {
+    const double Kstar=getRenormalizationFixedPoint();
+    if(!rgCriticalKnown && std::isnan(Kstar)) {
+        rgCritical=NAN;
+        rgCriticalKnown=true;
+    }
+    if(!rgCriticalKnown) {
+        // Flows near the separatrix linger at the fixed point; those 
+        // still there after all steps are judged by the side they are on
+        auto orders=[&](const double K0) {
+            double K   =K0;
+            double KGap=K0;
+            double h   =0;
+            for(int step=0; step < 200; step++) {
+                renormalizeCouplings(K,KGap,h,&K,&KGap,&h);
+                if(K >= 50  ) return true;
+                if(K <= 1e-4) return false;
+            }
+            return K > Kstar;
+        };
+        double lo=1e-3;
+        double hi=NAN;
+        for(double K=2*lo; K < 1e2; K*=2) {
+            if(orders(K)) {
+                hi=K;
+                break;
+            }
+            lo=K;
+        }
+        rgCritical=NAN;
+        if(!std::isnan(hi)) {
+            for(int iter=0; iter < 50; iter++) {
+                double mid=(lo+hi)/2;
+                if(orders(mid)) hi=mid;
+                else            lo=mid;
+            }
+            rgCritical=(lo+hi)/2;
+        }
+        rgCriticalKnown=true;
+    }
+    return J*pow(hausdorffScale,(latticeDepth-1)*interactionSigma)/rgCritical;
+}
+
+
+/* (double) getRenormalizationCorrelationExponent
+ *    | nu = ln b / ln lambda, with lambda = dK'/dK at the fixed point and
+ *    | the lengths rescaled by b = 1/s per decimation
+ *  O | (double) nu, or NAN without a fixed point
+ */
+const double IsingModel::getRenormalizationCorrelationExponent() {
+    const double Kstar=getRenormalizationFixedPoint();
+    if(std::isnan(Kstar)) return NAN;
+
+    const double dK=1e-5*Kstar;
+    double Kp, Km, KGap1, h1;
+    renormalizeCouplings(Kstar+dK,rgRigidGap,0,&Kp,&KGap1,&h1);
+    renormalizeCouplings(Kstar-dK,rgRigidGap,0,&Km,&KGap1,&h1);
+    return log(1/hausdorffScale)/log((Kp-Km)/(2*dK));
+}
+
+
+/* (void) computeAxisPositions
+ *    | Coordinate of each of the L=2n^d site positions along an axis,
+ *    | measured from the lattice origin. Position r is corner r%2 of the 
+ *    | hypercube whose base-n digits are r/2; digit iDepth places the 
+ *    | hypercube at scale s^(d-iDepth)
+ *  I | (int) depth of the lattice
+ *    | (double) length of the lattice edge
+ */
+void IsingModel::computeAxisPositions(const int depth, const double delta) {
+    int L = latticeDimensions.at(0);
+    int n = hausdorffSlices;
+
+    latticeAxisPos.resize(L);
+    for(int r=0; r < L; r++) {
+        int cube=r/2;
+        latticeAxisPos[r] = (r%2) * pow(hausdorffScale,depth)*delta;
+        for(int iDepth=0; iDepth < depth; iDepth++) {
+            int depthVal = cube%n;
+            double depthScale = pow(hausdorffScale,depth-iDepth)*delta;
+            latticeAxisPos[r] += (1 + (1/hausdorffScale-hausdorffSlices)/(hausdorffSlices-1))
+                                 *depthScale
+                                 *depthVal;
+            cube/=n;
+        }
+    }
+}
+
+
+/* (void) addSpins 
+ *    | Adds spins to the spinArray in their final (sorted) order. Along each
+ *    | axis the lattice has L=2n^d site positions: position r is corner r%2
+ *    | of the smallest hypercube whose base-n digits are r/2, so the sites
+ *    | are laid out row-major in r without any sorting
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *  I | (int) depth to build to
+ *    | (double) vector of coordinates to start fractal at
+ *    | (double) vector of coordinates to end fractal at
+ */
+template<int P>
+void IsingModel::addSpins(const int depth,
+        const std::vector<double>& x0, 
+        const std::vector<double>& x1) {
+        
+    if(debug) std::cout<<"\taddSpins:"<<std::endl;
+
+    const int p = (P > 0 ? P : latticeDimensions.size());
+    const int L = latticeDimensions.at(0);
+
+    computeAxisPositions(depth,fabs(x1.at(0)-x0.at(0)));
+    const std::vector<double>& axisPos=latticeAxisPos;
+
+    // Site i sits at position r_j = (i / L^(p-1-j)) % L along axis j
+    // Each thread fills a slab of the top-level sub-blocks along axis 0
+    nSpins=pow(L,p);
+    spinArray.resize(nSpins);
+    spinActiveBuf.resize(nSpins);
+    spinCoordsBuf.resize(nSpins*p);
+    splitAcrossThreads(nSpins,nSpins/L,
+        [&](const int chunk, const int first, const int last) {
+            std::fill(spinArray.begin()+first,spinArray.begin()+last,1);
+            std::fill(spinActiveBuf.begin()+first,spinActiveBuf.begin()+last,1);
+            for(int i=first; i < last; i++) {
+                for(int j=p-1,index=i; j >= 0; j--, index/=L) {
+                    spinCoordsBuf[i*p+j] = x0.at(j) + axisPos[index%L];
+                }
+            }
+        });
+    spinActive=spinActiveBuf.data();
+    spinCoords=spinCoordsBuf.data();
+
+    if(debug) std::cout<<"\t\t- spinArray made, "<<nSpins<<" spins"<<std::endl;
+}
+
+
+/* (void) setup 
+ *    | Prepare the class object for simulation 
+ */
+void IsingModel::setup() {
+    if(debug) std::cout<<"\tSETUP:"<<std::endl;
+    clearReplicas();
+    clearRenormalization();
+    
+    // Calculate the lattice dimensions from the input
+    // Hausdorff dimension
+    // (See my notes for derivation)
+    if(hausdorffMethod=="SCALING") {
+        hausdorffScale=exp(-ceil(hausdorffDim)*log(hausdorffSlices)/hausdorffDim);
+    }
+
+    // Check that the dimensions are reasonable
+    if(hausdorffScale > 1/hausdorffSlices) {
+        std::cout<<"ERROR: Invalid Hausdorff scaling"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+
+    // Check that the interactions are known to the MC method
+    if(interactionRange!="NEAREST" && interactionRange!="CUTOFF" 
+                                   && interactionRange!="LONGRANGE") {
+        std::cout<<"ERROR: Unknown interaction range "<<interactionRange<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+    if(interactionRange=="LONGRANGE" && (mcMethod=="HYBRID" || mcMethod=="SWENDSEN_WANG" 
+                                                    || mcMethod=="WOLFF")) {
+        std::cout<<"ERROR: "<<mcMethod<<" MC needs NEAREST or CUTOFF interactions"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+    if(interactionRange=="CUTOFF" && latticeStorage=="IMPLICIT") {
+        std::cout<<"ERROR: CUTOFF interactions need an EXPLICIT lattice"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+
+    // Keep track of the number of site coordinates along each axis,
+    // and of the index offset of a step along each axis
+    for(int i=0; i<ceil(hausdorffDim); i++) {
+        latticeDimensions.push_back(2*pow(hausdorffSlices,latticeDepth));
+    }
+    int p=latticeDimensions.size();
+    for(int j=0; j < p; j++) {
+        latticeStrides.push_back(pow(latticeDimensions.at(j),p-1-j));
+    }
+    if(pow(latticeDimensions.at(0),p) > INT_MAX) {
+        std::cout<<"ERROR: Lattice has too many spins"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+
+    // Generate the lattice array
+    std::vector<double> x0;
+    std::vector<double> x1;
+    for(size_t i=0; i<latticeDimensions.size(); i++) {
+        x0.push_back(0);
+        x1.push_back(1);
+    }
+
+    // Build the lattice with kernels specialised on p
+    switch(p) {
+        case 1:  setupLattice<1>(x0,x1); break;
+        case 2:  setupLattice<2>(x0,x1); break;
+        case 3:  setupLattice<3>(x0,x1); break;
+        case 4:  setupLattice<4>(x0,x1); break;
+        default: setupLattice<0>(x0,x1); break;
+    }
+
+    hasBeenSetup=true;
+}
+
+
+/* (string) getLatticeCachePath
+ *    | File holding the cached geometry for the current lattice settings
+ */
+std::string IsingModel::getLatticeCachePath() {
+    char name[512];
+    if(interactionRange=="CUTOFF") {
+        snprintf(name, sizeof(name), "%s/lattice_%.10gD_d%i_n%i_%s_rc%.10g.bin",
+                 latticeCacheDir.c_str(), hausdorffDim, latticeDepth,
+                 int(hausdorffSlices), hausdorffMethod.c_str(), cutoffRadius);
+        return std::string(name);
+    }
+    snprintf(name, sizeof(name), "%s/lattice_%.10gD_d%i_n%i_%s.bin",
+             latticeCacheDir.c_str(), hausdorffDim, latticeDepth,
+             int(hausdorffSlices), hausdorffMethod.c_str());
+    return std::string(name);
+}
+
+
+/* (void) getLatticeCacheLayout
+ *    | Byte sizes and offsets of the arrays in a lattice cache file. Each 
+ *    | array starts on an 8-byte boundary after the header:
+ *    |   spinActive [nSpins] char, spinCoords [nSpins*p] double,
+ *    |   nbrOffsets [nSpins+1] int, nbrIndices [nBonds] int,
+ *    |   nbrDistSq [nBonds] double
+ *  I | (latticeCacheHeader) header of the file
+ *  O | (size_t[5]) sizes of the five arrays
+ *    | (size_t[6]) offsets of the five arrays, then the file size
+ */
+void IsingModel::getLatticeCacheLayout(const latticeCacheHeader& hdr, 
+        size_t* sizes, size_t* offsets) {
+    sizes[0] = size_t(hdr.nSpins)*sizeof(char);
+    sizes[1] = size_t(hdr.nSpins)*hdr.p*sizeof(double);
+    sizes[2] = size_t(hdr.nSpins+1)*sizeof(int);
+    sizes[3] = size_t(hdr.nBonds)*sizeof(int);
+    sizes[4] = size_t(hdr.nBonds)*sizeof(double);
+    offsets[0] = (sizeof(latticeCacheHeader)+7)/8*8;
+    for(int a=0; a < 5; a++) offsets[a+1] = offsets[a] + (sizes[a]+7)/8*8;
+}
+
+
+/* (bool) loadLatticeCache
+ *    | Map a cached lattice geometry read-only into memory. The pages are
+ *    | shared between all processes on a node that map the same file
+ *  O | (bool) whether a valid cache file for these settings was found
+ */
+bool IsingModel::loadLatticeCache() {
+    std::string path = getLatticeCachePath();
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+
+    struct stat st;
+    if(fstat(fd,&st) != 0 || size_t(st.st_size) < sizeof(latticeCacheHeader)) {
+        close(fd);
+        return false;
+    }
+    void* map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return false;
+
+    // Only accept a file written by this version for exactly these settings
+    const latticeCacheHeader& hdr = *(const latticeCacheHeader*) map;
+    size_t sizes[5], offsets[6];
+    getLatticeCacheLayout(hdr, sizes, offsets);
+    if(std::memcmp(hdr.magic, latticeCacheMagic, sizeof(hdr.magic)) != 0
+       || hdr.version != latticeCacheVersion
+       || hdr.p       != int(latticeDimensions.size())
+       || hdr.depth   != latticeDepth
+       || hdr.slices  != int(hausdorffSlices)
+       || hdr.dim     != hausdorffDim
+       || hdr.scale   != hausdorffScale
+       || std::strncmp(hdr.method, hausdorffMethod.c_str(), sizeof(hdr.method)-1) != 0
+       || offsets[5]  != size_t(st.st_size)) {
+        if(debug) std::cout<<"\t\t- ignoring stale lattice cache "<<path<<std::endl;
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    const char* base = (const char*) map;
+    latticeMap     = map;
+    latticeMapSize = st.st_size;
+    nSpins         = hdr.nSpins;
+    nBonds         = hdr.nBonds;
+    spinActive     = (const char*  ) (base+offsets[0]);
+    spinCoords     = (const double*) (base+offsets[1]);
+    nbrOffsets     = (const int*   ) (base+offsets[2]);
+    nbrIndices     = (const int*   ) (base+offsets[3]);
+    nbrDistSq      = (const double*) (base+offsets[4]);
+
+    if(debug) std::cout<<"\t\t- mapped lattice cache "<<path<<std::endl;
+    return true;
+}
+
+
+/* (void) writeLatticeCache
+ *    | Save the lattice geometry for later runs. The file is written under
+ *    | a temporary name and renamed, so concurrent jobs never see a 
+ *    | partial file
+ */
+void IsingModel::writeLatticeCache() {
+    latticeCacheHeader hdr;
+    std::memset(&hdr, 0, sizeof(hdr));
+    std::memcpy(hdr.magic, latticeCacheMagic, sizeof(hdr.magic));
+    hdr.version = latticeCacheVersion;
+    hdr.p       = latticeDimensions.size();
+    hdr.depth   = latticeDepth;
+    hdr.slices  = hausdorffSlices;
+    hdr.dim     = hausdorffDim;
+    hdr.scale   = hausdorffScale;
+    hdr.nSpins  = nSpins;
+    hdr.nBonds  = nBonds;
+    std::strncpy(hdr.method, hausdorffMethod.c_str(), sizeof(hdr.method)-1);
+
+    size_t sizes[5], offsets[6];
+    getLatticeCacheLayout(hdr, sizes, offsets);
+    const void* arrays[5] = { spinActive, spinCoords, nbrOffsets, nbrIndices, nbrDistSq };
+
+    std::string path = getLatticeCachePath();
+    char tmpPath[512];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%i.tmp", path.c_str(), int(getpid()));
+
+    FILE* f = fopen(tmpPath, "wb");
+    if(!f) {
+        std::cout<<"WARNING: Could not write lattice cache "<<path<<std::endl;
+        return;
+    }
+    static const char padding[8] = {0};
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1
+              && fwrite(padding, 1, offsets[0]-sizeof(hdr), f) == offsets[0]-sizeof(hdr);
+    for(int a=0; a < 5 && ok; a++) {
+        size_t pad = offsets[a+1]-offsets[a]-sizes[a];
+        ok = fwrite(arrays[a], 1, sizes[a], f) == sizes[a]
+             && fwrite(padding, 1, pad, f) == pad;
+    }
+    ok = (fclose(f) == 0) && ok;
+
+    if(!ok || rename(tmpPath, path.c_str()) != 0) {
+        std::cout<<"WARNING: Could not write lattice cache "<<path<<std::endl;
+        remove(tmpPath);
+    } else if(debug) std::cout<<"\t\t- wrote lattice cache "<<path<<std::endl;
+}
+
+
+/* (void) setupLattice
+ *    | Generate the lattice geometry and select the MC kernels for an
+ *    | embedding dimension p known at compile time
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *  I | (double) vector of coordinates to start fractal at
+ *    | (double) vector of coordinates to end fractal at
+ */
+template<int P>
+void IsingModel::setupLattice(const std::vector<double>& x0,
+                              const std::vector<double>& x1) {
+    startThreads();
+
+    // An implicit lattice only needs the spins and the axis positions.
+    // Otherwise reuse a cached geometry if there is one, else build 
+    // and cache it
+    implicitLattice = (latticeStorage=="IMPLICIT");
+    if(implicitLattice) {
+        computeAxisPositions(latticeDepth,1);
+        nSpins=pow(latticeDimensions.at(0),latticeDimensions.size());
+        spinArray.assign(nSpins,1);
+    } else if(latticeCacheDir.empty() || !loadLatticeCache()) {
+        addSpins<P>(latticeDepth,x0,x1);
+        if(interactionRange=="CUTOFF") buildCutoffTable<P>();
+        else                           buildNeighborTable<P>();
+        if(!latticeCacheDir.empty()) writeLatticeCache();
+    } else {
+        computeAxisPositions(latticeDepth,1);
+        spinArray.assign(nSpins,1);
+    }
+    computeCouplings();
+
+    longRange = (interactionRange=="LONGRANGE");
+    if(longRange) buildCellTree();
+
+    maxNeighbors = 2*latticeStrides.size();
+    if(!implicitLattice) {
+        for(int i=0; i < nSpins; i++) 
+            maxNeighbors = std::max(maxNeighbors,nbrOffsets[i+1]-nbrOffsets[i]);
+    }
+    metropolisTable.clear();
+    heatBathTable.clear();
+
+    allSpinsActive = !spinActive || std::count(spinActive,spinActive+nSpins,0) == 0;
+    bitPackedSpins = (spinStorage=="BITPACKED");
+    if(bitPackedSpins) packSpins();
+
+    // Sweep whole components, or else the color classes, in parallel 
+    // when running on several threads
+    buildComponents();
+    if(threadPool) buildColoring();
+    if(threadPool && longRange) 
+        std::cout<<"WARNING: LONGRANGE sweeps run on a single thread"<<std::endl;
+
+    selectKernels<P>();
+    recomputeObservables();
+}
+
+
+/* (void) selectKernels
+ *    | Point the MC kernels at the sweeps for the lattice and spin storage:
+ *    | the color class sweeps if there is a coloring, else sequential ones
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ */
+template<int P>
+void IsingModel::selectKernels() {
+    if(componentSweeps) {
+        metropolisKernel = &IsingModel::componentStep<P,false,false>;
+        heatBathKernel   = &IsingModel::componentStep<P,false,true >;
+    } else if(!colorOffsets.empty()) {
+        metropolisKernel = bitPackedSpins ? &IsingModel::colorStep<P,true ,false> 
+                                          : &IsingModel::colorStep<P,false,false>;
+        heatBathKernel   = bitPackedSpins ? &IsingModel::colorStep<P,true ,true > 
+                                          : &IsingModel::colorStep<P,false,true >;
+    } else if(bitPackedSpins) {
+        metropolisKernel = &IsingModel::metropolisStep<P,true>;
+        heatBathKernel   = &IsingModel::heatBathStep<P,true>;
+    } else {
+        metropolisKernel = &IsingModel::metropolisStep<P,false>;
+        heatBathKernel   = &IsingModel::heatBathStep<P,false>;
+    }
+    swendsenWangKernel = bitPackedSpins ? &IsingModel::swendsenWangStep<P,true > 
+                                        : &IsingModel::swendsenWangStep<P,false>;
+    wolffKernel        = bitPackedSpins ? &IsingModel::wolffStep<P,true > 
+                                        : &IsingModel::wolffStep<P,false>;
+    multiSpinKernel    = &IsingModel::multiSpinStep<P>;
+    wangLandauKernel   = bitPackedSpins ? &IsingModel::wangLandauWalk<P,true > 
+                                        : &IsingModel::wangLandauWalk<P,false>;
+}
+
+
+/* (void) runMonteCarlo 
+ *    | Run the Monte Carlo simulation (spin-flipping) 
+ */
+void IsingModel::runMonteCarlo() {
+    if(debug) std::cout<<"\tRunMonteCarlo:"<<std::endl;
+    if(!hasBeenSetup) {
+        std::cout<<"ERROR: Object has not been setup!"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+    
+    // Various utils 
+    TRandom3* rNG = new TRandom3(); 
+
+    double avgAbsDeltaE=-1;
+    int nSpinsPerThread = floor(nSpins/nThreads);
+    int cNumThreads=nThreads;
+    //std::vector<boost::thread*> threads;
+
+    // Start performing MC steps
+    for(int i=0; i < nMCSteps; i++) {
+        if(debug && nMCSteps < 100) std::cout<<"\t\t At MC Step "
+                                             <<i<<"/"<<nMCSteps<<std::endl;
+
+
+        double newAvgAbsDeltaE=0;
+        for(int iDE=0,lMCI=mcInfo.size(); iDE < lMCI; iDE++)
+             newAvgAbsDeltaE+=(mcInfo.at(iDE));
+        mcInfo.clear();
+
+        //std::cout<<" - "<<newAvgAbsDeltaE<<" "<<avgAbsDeltaE<<std::endl;
+
+             if(mcMethod=="METROPOLIS") (this->*metropolisKernel)(rNG);
+        else if(mcMethod=="HEATBATH")   (this->*heatBathKernel)(rNG);
+        else if(mcMethod=="SWENDSEN_WANG") (this->*swendsenWangKernel)(rNG);
+        else if(mcMethod=="WOLFF")      (this->*wolffKernel)(rNG);
+        else if(mcMethod=="HYBRID") {
+            
+            // Prepare threads
+            //int currentNThreads=0;
+
+            // Create a vector of spin indices
+            int popVectorSize=nSpins;
+            std::vector<int> popVector(nSpins);
+            for(int j=0; j < nSpins; j++) popVector.at(j)=j;
+
+            if(nSpinsPerThread < 1) nSpinsPerThread=1;
+            // Based upon the previous running average of Delta E,
+            // choose whether to increase the number of threads
+                                        
                                                                            // Decrease spins/thread:
             if(nSpinsPerThread > 1 && (newAvgAbsDeltaE > avgAbsDeltaE*2    // if energy change is growing fast
                                         || newAvgAbsDeltaE <= avgAbsDeltaE  // if we are converging on minimum
@@ -462,112 +2331,1528 @@ void IsingModel::runMonteCarlo() {
                                     <<nSpinsPerThread<<" spins / thread"<<std::endl;   
             }
 
-            
-            // Loop through threads
-            while(popVectorSize>0) {
+            
+            // Loop through threads
+            while(popVectorSize>0) {
+
+                // Generate array of spins to flip for thread
+                // by ripping apart vector of spin indices 
+                std::vector<int> spinFlips;
+                if(nSpinsPerThread > popVector.size()) {
+                    spinFlips=popVector;
+                    popVector.clear();
+                    popVectorSize=0;
+                } else {
+                    spinFlips.reserve(nSpinsPerThread);
+                    for(int j=0; j < nSpinsPerThread; j++){ 
+                        int index=rNG->Integer(popVectorSize);
+                        spinFlips.push_back(popVector.at(index));
+                        popVector.at(index)=popVector.back();
+                        popVector.pop_back();
+                        popVectorSize--;
+                    }
+                }
+
+                // Save thread info outside of scope
+                // and submit the thread
+                //boost::thread * tThread
+                //    = new boost::thread(&IsingModel::heatBathStep,this,rNG->Uniform(),spinFlips);
+                ///threads.push_back(tThread);
+                hybridStep(rNG->Uniform(),spinFlips);
+
+                //currentNThreads++;
+            }
+
+            // Let them run in sequence
+            //for(int iThread; iThread<currentNThreads; iThread++) {
+            //    //threads.at(iThread)->join();
+            //}
+        }
+
+
+        if(avgAbsDeltaE >= 0) hybridInfo.push_back(avgAbsDeltaE);
+        avgAbsDeltaE=newAvgAbsDeltaE;   
+            
+    }
+
+    delete rNG;
+}
+
+
+/* (void) runParallelTempering
+ *    | Run the Monte Carlo simulation on one replica per temperature of
+ *    | the ladder (see setTemperatureLadder). Each MC step sweeps all 
+ *    | replicas at once, one per thread, and every swapInterval steps 
+ *    | neighboring temperatures k, k+1 swap their replicas a, b with 
+ *    | probability min(1, exp((1/kbT_k - 1/kbT_k+1)*(E_a - E_b))), 
+ *    | alternating between the even and the odd pairs. The replicas 
+ *    | start from the current spins and carry on from one run to the next
+ */
+void IsingModel::runParallelTempering() {
+    if(debug) std::cout<<"\tRunParallelTempering:"<<std::endl;
+    if(!hasBeenSetup) {
+        std::cout<<"ERROR: Object has not been setup!"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+    if(ladderkbT.size() < 2) {
+        std::cout<<"ERROR: Parallel tempering needs at least 2 temperatures"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+    if(mcMethod=="HYBRID") {
+        std::cout<<"ERROR: HYBRID MC cannot run parallel tempering"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+
+    // replicas[k] is at ladder temperature k
+    const int nReplicas=ladderkbT.size();
+    if(replicas.empty()) {
+        for(int k=0; k < nReplicas; k++) replicas.push_back(makeReplica(ladderkbT[k]));
+    }
+    for(int k=0; k < nReplicas; k++) replicas[k]->setCouplingConsts(H,J);
+
+    // The replicas carry on from the last run: draw a fresh seed
+    TRandom3* rNG = new TRandom3(0); 
+    std::vector<TRandom3*> replicaRNGs;
+    for(int k=0; k < nReplicas; k++) 
+        replicaRNGs.push_back(new TRandom3(rNG->Integer(UINT_MAX)+1));
+
+    std::vector<int> nAttempted(nReplicas-1,0);
+    std::vector<int> nAccepted (nReplicas-1,0);
+    ladderMag.assign   (nReplicas,0);
+    ladderAbsMag.assign(nReplicas,0);
+    ladderEffH.assign  (nReplicas,0);
+
+    for(int i=0; i < nMCSteps; i++) {
+        splitAcrossThreads(nReplicas,1,
+            [&](const int chunk, const int first, const int last) {
+                for(int k=first; k < last; k++) replicaStep(replicas[k],replicaRNGs[k]);
+            });
+
+        if((i+1)%swapInterval == 0) {
+            for(int k=((i+1)/swapInterval)%2; k+1 < nReplicas; k+=2) {
+                IsingModel* a=replicas[k];
+                IsingModel* b=replicas[k+1];
+                double Ea = -H*a->magnetization - J*a->bondSum;
+                double Eb = -H*b->magnetization - J*b->bondSum;
+                double logP = (1/ladderkbT[k] - 1/ladderkbT[k+1])*(Ea - Eb);
+                nAttempted[k]++;
+                if(logP >= 0 || rNG->Uniform() < exp(logP)) {
+                    std::swap(replicas[k],replicas[k+1]);
+                    replicas[k  ]->setTemperature(ladderkbT[k  ]);
+                    replicas[k+1]->setTemperature(ladderkbT[k+1]);
+                    nAccepted[k]++;
+                }
+            }
+        }
+
+        for(int k=0; k < nReplicas; k++) {
+            ladderMag[k]    += replicas[k]->magnetization;
+            ladderAbsMag[k] += abs(replicas[k]->magnetization);
+            ladderEffH[k]   += replicas[k]->getEffHamiltonian();
+        }
+    }
+
+    swapAcceptance.assign(nReplicas-1,0);
+    for(int k=0; k < nReplicas; k++) {
+        ladderMag[k]    /= nMCSteps;
+        ladderAbsMag[k] /= nMCSteps;
+        ladderEffH[k]   /= nMCSteps;
+        if(k+1 < nReplicas && nAttempted[k] > 0) 
+            swapAcceptance[k] = double(nAccepted[k])/nAttempted[k];
+    }
+
+    if(debug) {
+        for(int k=0; k < nReplicas; k++) {
+            std::cout<<"\t\t- kbT = "<<ladderkbT[k]<<": <m> = "<<ladderMag[k]
+                     <<", <|m|> = "<<ladderAbsMag[k]<<", <beta H> = "<<ladderEffH[k];
+            if(k+1 < nReplicas) std::cout<<", swaps accepted "<<swapAcceptance[k];
+            std::cout<<std::endl;
+        }
+    }
+
+    for(int k=0; k < nReplicas; k++) delete replicaRNGs[k];
+    delete rNG;
+}
+
+
+/* (double) replicaStep
+ *    | Perform one MC step of a replica, with the MC method of the model
+ *  I | (IsingModel*) replica, see makeReplica
+ *    | (TRandom3*) pointer to random number generator
+ *  O | (double) effective energy after the step
+ */
+double IsingModel::replicaStep(IsingModel* replica, TRandom3* rNG) {
+    double effH=0;
+         if(mcMethod=="METROPOLIS")    effH=(replica->*replica->metropolisKernel)(rNG);
+    else if(mcMethod=="HEATBATH")      effH=(replica->*replica->heatBathKernel)(rNG);
+    else if(mcMethod=="SWENDSEN_WANG") effH=(replica->*replica->swendsenWangKernel)(rNG);
+    else if(mcMethod=="WOLFF")         effH=(replica->*replica->wolffKernel)(rNG);
+    replica->mcInfo.clear();
+    return effH;
+}
+
+
+/* (IsingModel*) makeReplica
+ *    | Make a copy of the model at another temperature for parallel
+ *    | tempering. It points at the spin and bond arrays of this model,
+ *    | which must outlive it, and copies the small per-axis and per-cell
+ *    | arrays. It owns its spins, starting from the current ones, and 
+ *    | runs on a single thread
+ *  I | (double) value of k_B * T of the replica
+ *  O | (IsingModel*) dynamically allocated replica
+ */
+IsingModel* IsingModel::makeReplica(const double tkbT) {
+    IsingModel* replica=new IsingModel();
+
+    // Settings
+    replica->nMCSteps        =nMCSteps;
+    replica->latticeDepth    =latticeDepth;
+    replica->interactionSigma=interactionSigma;
+    replica->hausdorffDim    =hausdorffDim;
+    replica->hausdorffSlices =hausdorffSlices;
+    replica->hausdorffScale  =hausdorffScale;
+    replica->hausdorffMethod =hausdorffMethod;
+    replica->mcMethod        =mcMethod;
+    replica->latticeStorage  =latticeStorage;
+    replica->spinStorage     =spinStorage;
+    replica->interactionRange=interactionRange;
+    replica->cutoffRadius    =cutoffRadius;
+    replica->openingAngle    =openingAngle;
+    replica->kbT             =tkbT;
+    replica->H               =H;
+    replica->J               =J;
+
+    // Geometry
+    replica->nSpins           =nSpins;
+    replica->spinActive       =spinActive;
+    replica->spinCoords       =spinCoords;
+    replica->allSpinsActive   =allSpinsActive;
+    replica->latticeDimensions=latticeDimensions;
+    replica->latticeStrides   =latticeStrides;
+    replica->latticeAxisPos   =latticeAxisPos;
+    replica->implicitLattice  =implicitLattice;
+    replica->axisCouplings    =axisCouplings;
+    replica->nbrOffsets       =nbrOffsets;
+    replica->nbrIndices       =nbrIndices;
+    replica->nbrDistSq        =nbrDistSq;
+    replica->nbrCouplings     =nbrCouplings;
+    replica->nBonds           =nBonds;
+    replica->maxNeighbors     =maxNeighbors;
+    replica->bitPackedSpins   =bitPackedSpins;
+    replica->bondMasks        =bondMasks;
+    replica->longRange        =longRange;
+    replica->cellWidth        =cellWidth;
+    replica->cellOffsets      =cellOffsets;
+    replica->cellAxisOffsets  =cellAxisOffsets;
+    replica->cellAxisCenter   =cellAxisCenter;
+    replica->cellDiameterSq   =cellDiameterSq;
+
+    // Spins and observables
+    replica->spinArray    =spinArray;
+    replica->spinBits     =spinBits;
+    replica->cellCharge   =cellCharge;
+    replica->cellDipole   =cellDipole;
+    replica->magnetization=magnetization;
+    replica->bondSum      =bondSum;
+
+    switch(latticeStrides.size()) {
+        case 1:  replica->selectKernels<1>(); break;
+        case 2:  replica->selectKernels<2>(); break;
+        case 3:  replica->selectKernels<3>(); break;
+        case 4:  replica->selectKernels<4>(); break;
+        default: replica->selectKernels<0>(); break;
+    }
+    replica->hasBeenSetup=true;
+    return replica;
+}
+
+
+/* (void) clearReplicas
+ *    | Delete the replicas of runParallelTempering
+ */
+void IsingModel::clearReplicas() {
+    for(size_t k=0; k < replicas.size(); k++) delete replicas[k];
+    replicas.clear();
+}
+
+
+/* (void) runMultiSpinMonteCarlo
+ *    | Run Metropolis sweeps on 64 replicas of the lattice at once, with
+ *    | multi-spin coding: a 64-bit word holds site i of every replica (see
+ *    | multiSpinStep). The replicas start from random spins and carry on 
+ *    | from one run to the next, until reset. Needs uniform couplings 
+ *    | (sigma = 0) and NEAREST or CUTOFF interactions
+ */
+void IsingModel::runMultiSpinMonteCarlo() {
+    if(debug) std::cout<<"\tRunMultiSpinMonteCarlo:"<<std::endl;
+    if(!hasBeenSetup) {
+        std::cout<<"ERROR: Object has not been setup!"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+    if(interactionSigma != 0 || longRange) {
+        std::cout<<"ERROR: Multi-spin coding needs sigma = 0 and NEAREST or CUTOFF interactions"
+                 <<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+
+    TRandom3* rNG = new TRandom3(0); 
+
+    if(multiSpinWords.empty()) {
+        multiSpinWords.resize(nSpins);
+        for(int i=0; i < nSpins; i++) {
+            multiSpinWords[i] = uint64_t(rNG->Uniform()*4294967296.0) << 32 
+                              | uint64_t(rNG->Uniform()*4294967296.0);
+        }
+    }
+
+    for(int i=0; i < nMCSteps; i++) (this->*multiSpinKernel)(rNG);
+
+    delete rNG;
+}
+
+
+/* (void) multiSpinStep
+ *    | Perform one Metropolis run over the lattice for all 64 replicas of
+ *    | multiSpinWords, on the color classes when running on several threads
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *  I | (TRandom3*) pointer to random number generator
+ */
+template<int P>
+void IsingModel::multiSpinStep(TRandom3* rNG) {
+    updateAcceptanceTables();
+    const double* table=&metropolisTable[maxNeighbors];
+
+    if(colorOffsets.empty()) {
+        for(int i=0; i < nSpins; i++) {
+            if (isActive(i)) updateMultiSpinWord<P>(i,table,rNG);
+        }
+        return;
+    }
+
+    for(size_t c=0; c+1 < colorOffsets.size(); c++) {
+        const int first=colorOffsets[c];
+        const int n    =colorOffsets[c+1]-first;
+        threadPool->run([&](const int t) {
+            for(int e=first+long(n)*t/nThreads; e < first+long(n)*(t+1)/nThreads; e++) 
+                updateMultiSpinWord<P>(colorSpins[e],table,threadRNGs[t]);
+        });
+    }
+}
+
+
+/* (void) updateMultiSpinWord
+ *    | Metropolis update of site i in all 64 replicas with word operations.
+ *    | The number a of anti-aligned neighbors of each replica is summed in
+ *    | bit-sliced binary, planes[b] holding bit b of a for every replica.
+ *    | The replicas with the same a and S_i share one acceptance 
+ *    | probability p, and each replica r accepts if its own uniform u_r 
+ *    | is below p. The u_r are also bit-sliced, random[k] holding bit k
+ *    | after the binary point, and drawn lazily from the most significant
+ *    | bit on: comparing u_r with p stops at the first bit where they
+ *    | differ, so a few words decide all 64 replicas. Each site shares the
+ *    | u_r between all its classes, but no two replicas share one, which
+ *    | keeps the replicas independent
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *  I | (int) index of the spin
+ *    | (double*) Metropolis acceptance table, see updateAcceptanceTables
+ *    | (TRandom3*) pointer to random number generator
+ */
+template<int P>
+inline void IsingModel::updateMultiSpinWord(const int i, const double* table, TRandom3* rNG) {
+    const uint64_t w=multiSpinWords[i];
+    const int      z=maxNeighbors;
+
+    uint64_t planes[32]={0};
+    int nPlanes=0;
+    int nNeighbors=0;
+    forEachNeighbor<P>(i,[&](const int j, const double coupling) {
+        uint64_t carry=w^multiSpinWords[j];
+        for(int b=0; carry; b++) {
+            uint64_t next=planes[b]&carry;
+            planes[b]^=carry;
+            carry=next;
+            nPlanes=std::max(nPlanes,b+1);
+        }
+        nNeighbors++;
+    });
+
+    uint64_t random[32];
+    int      nRandom=0;
+    uint64_t flips=0;
+    for(int a=0; a <= nNeighbors && (a>>nPlanes) == 0; a++) {
+        uint64_t withA=~0ULL;
+        for(int b=0; b < nPlanes; b++) withA &= ((a>>b)&1) ? planes[b] : ~planes[b];
+        if(!withA) continue;
+
+        for(int si=-1; si <= 1; si+=2) {
+            uint64_t inClass = withA & (si > 0 ? w : ~w);
+            if(!inClass) continue;
+
+            // Neighbor sum f = S_i*(nNeighbors-2a)
+            double prob=table[(si > 0 ? 2*z+1 : 0) + si*(nNeighbors-2*a)];
+            if(prob >= 1) {
+                flips |= inClass;
+                continue;
+            }
+            uint32_t threshold=uint32_t(prob*4294967296.0);
+            uint64_t undecided=inClass;
+            for(int k=0; k < 32 && undecided; k++) {
+                if(k == nRandom) {
+                    random[nRandom++] = uint64_t(rNG->Uniform()*4294967296.0) << 32 
+                                      | uint64_t(rNG->Uniform()*4294967296.0);
+                }
+                if((threshold>>(31-k))&1) {
+                    flips     |= undecided & ~random[k];
+                    undecided &= random[k];
+                } else {
+                    undecided &= ~random[k];
+                }
+            }
+        }
+    }
+    multiSpinWords[i] = w^flips;
+}
+
+
+/* (vector<int>) getMultiSpinMagnetizations
+ *    | Returns the magnetization of each replica of runMultiSpinMonteCarlo
+ */
+const std::vector<int> IsingModel::getMultiSpinMagnetizations() {
+    std::vector<int> mag(64,0);
+    for(int i=0; i < int(multiSpinWords.size()); i++) {
+        if (!isActive(i)) continue;
+        for(int r=0; r < 64; r++) mag[r] += ((multiSpinWords[i]>>r)&1) ? 1 : -1;
+    }
+    return mag;
+}
+
+
+/* (vector<double>) getMultiSpinEffHamiltonians
+ *    | Returns the effective energy of each replica of runMultiSpinMonteCarlo
+ */
+const std::vector<double> IsingModel::getMultiSpinEffHamiltonians() {
+    const double h=geth();
+    const double K=getK();
+    std::vector<int> mag=getMultiSpinMagnetizations();
+    std::vector<double> effH(64,0);
+    for(int i=0; i < int(multiSpinWords.size()); i++) {
+        if (!isActive(i)) continue;
+        forEachNeighbor<0>(i,[&](const int j, const double coupling) {
+            if(j < i) return;
+            uint64_t antiAligned=multiSpinWords[i]^multiSpinWords[j];
+            for(int r=0; r < 64; r++) 
+                effH[r] -= K*coupling*(((antiAligned>>r)&1) ? -1 : 1);
+        });
+    }
+    for(int r=0; r < 64; r++) effH[r] -= h*mag[r];
+    return effH;
+}
+
+
+/* (vector<int>) getMultiSpinArray
+ *    | Returns an array of the spins (+1,-1, or 0) of one replica of
+ *    | runMultiSpinMonteCarlo
+ *  I | (int) replica, 0 ... 63
+ */
+const std::vector<int> IsingModel::getMultiSpinArray(const int replica) {
+    std::vector<int> spins(multiSpinWords.size());
+    for(int i=0; i < int(multiSpinWords.size()); i++) {
+        spins[i] = !isActive(i) ? 0 : ((multiSpinWords[i]>>replica)&1) ? 1 : -1;
+    }
+    return spins;
+}
+
+
+/* (void) runWangLandau
+ *    | Estimate the density of states g(bond sum), or g(bond sum, M) (see
+ *    | setWangLandauMagnetization), with Wang-Landau walkers that switch
+ *    | to the 1/t schedule once halving ln f would fall below it. The 
+ *    | bond sums from the lowest one a descent from all spins up reaches
+ *    | to the largest one, all spins up, are split into windows that
+ *    | overlap by half, one walker per window and thread. The windows
+ *    | are joined by matching ln g where they overlap, and g is 
+ *    | normalised to 2^N states. Each bin is placed at the mean bond sum
+ *    | the walkers saw in it, which is exact for uniform couplings. See getLogPartitionFunction for the 
+ *    | thermodynamics and writeDensityOfStates to save it
+ */
+void IsingModel::runWangLandau() {
+    if(debug) std::cout<<"\tRunWangLandau:"<<std::endl;
+    if(!hasBeenSetup) {
+        std::cout<<"ERROR: Object has not been setup!"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+    if(longRange) {
+        std::cout<<"ERROR: Wang-Landau needs NEAREST or CUTOFF interactions"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+
+    // The largest bond sum has all spins aligned
+    wangLandauWindow range;
+    double maxBonds=0;
+    range.nActive=0;
+    for(int i=0; i < nSpins; i++) {
+        if (!isActive(i)) continue;
+        range.nActive++;
+        forEachNeighbor<0>(i,[&](const int j, const double coupling) {
+            if(j > i) maxBonds += coupling;
+        });
+    }
+    if(interactionSigma == 0) {
+        range.nBondBins=lround(maxBonds)+1;
+        range.bondMin  =-maxBonds-1;
+        range.binWidth =2;
+    } else {
+        range.nBondBins=(wangLandauBins > 0) ? wangLandauBins : 1024;
+        range.bondMin  =-maxBonds;
+        range.binWidth =std::max(2*maxBonds,1.)/range.nBondBins;
+    }
+    range.magnetized=wangLandauMagnetization;
+    range.precision =wangLandauPrecision;
+    const int nM = range.magnetized ? range.nActive+1 : 1;
+    auto bondBin=[&](const double bonds) {
+        return std::min(range.nBondBins-1,int(floor((bonds-range.bondMin)/range.binWidth)));
+    };
+
+    TRandom3* rNG = new TRandom3(0); 
+
+    // Lowest bond sum in reach: descend towards bin 0 from all spins up
+    IsingModel* walker=makeReplica(kbT);
+    walker->setAllSpins(1);
+    wangLandauWindow descent=range;
+    descent.first    =0;
+    descent.last     =0;
+    descent.precision=1;
+    (walker->*walker->wangLandauKernel)(descent,rNG);
+    const int lowest=bondBin(walker->bondSum);
+    delete walker;
+
+    // Windows overlapping by half over [lowest, nBondBins)
+    const int span     = range.nBondBins-lowest;
+    const int nWalkers = std::max(1,std::min(nThreads,span/16));
+    std::vector<wangLandauWindow> windows(nWalkers,range);
+    std::vector<IsingModel*> walkers;
+    std::vector<TRandom3*  > walkerRNGs;
+    for(int k=0; k < nWalkers; k++) {
+        windows[k].first = (k == 0) ? 0 : lowest + long(span)*k/(nWalkers+1);
+        windows[k].last  = (k == nWalkers-1) ? range.nBondBins-1 
+                           : lowest + long(span)*(k+2)/(nWalkers+1) - 1;
+        walkers.push_back(makeReplica(kbT));
+        walkers[k]->setAllSpins(1);
+        walkerRNGs.push_back(new TRandom3(rNG->Integer(UINT_MAX)+1));
+    }
+    std::vector<char> entered(nWalkers,0);
+    splitAcrossThreads(nWalkers,1,
+        [&](const int chunk, const int first, const int last) {
+            for(int k=first; k < last; k++) {
+                entered[k] = (walkers[k]->*walkers[k]->wangLandauKernel)(windows[k],walkerRNGs[k]);
+            }
+        });
+    for(int k=0; k < nWalkers; k++) {
+        if(!entered[k]) {
+            std::cout<<"ERROR: Wang-Landau walker could not reach bond sums from "
+                     <<range.bondMin+windows[k].first*range.binWidth<<std::endl;
+            exit(EXIT_FAILURE); 
+        }
+        delete walkers[k];
+        delete walkerRNGs[k];
+    }
+    delete rNG;
+
+    // Join the windows, shifting each to the mean of ln g where it
+    // overlaps the ones before
+    std::vector<double> logG(range.nBondBins*nM,0);
+    std::vector<char  > visited(range.nBondBins*nM,0);
+    std::vector<double> bondTotal(range.nBondBins*nM,0);
+    std::vector<long  > bondCount(range.nBondBins*nM,0);
+    for(int k=0; k < nWalkers; k++) {
+        const int offset=windows[k].first*nM;
+        double shift=0;
+        int    nShared=0;
+        for(size_t e=0; e < windows[k].logG.size(); e++) {
+            if(!windows[k].visited[e] || !visited[offset+e]) continue;
+            shift += logG[offset+e]-windows[k].logG[e];
+            nShared++;
+        }
+        if(k > 0 && nShared == 0) {
+            std::cout<<"ERROR: Wang-Landau windows do not overlap"<<std::endl;
+            exit(EXIT_FAILURE); 
+        }
+        if(nShared > 0) shift /= nShared;
+        for(size_t e=0; e < windows[k].logG.size(); e++) {
+            if(!windows[k].visited[e]) continue;
+            double value=windows[k].logG[e]+shift;
+            logG[offset+e] = visited[offset+e] ? (logG[offset+e]+value)/2 : value;
+            visited[offset+e]=1;
+            bondTotal[offset+e] += windows[k].bondTotal[e];
+            bondCount[offset+e] += windows[k].bondCount[e];
+        }
+    }
 
-                // Generate array of spins to flip for thread
-                // by ripping apart vector of spin indices 
-                std::vector<int> spinFlips(nSpinsPerThread);
-                if(nSpinsPerThread > popVector.size()) {
-                    spinFlips=popVector;
-                    popVector.clear();
-                    popVectorSize=0;
-                } else {
-                    for(int j=0; j < nSpinsPerThread; j++){ 
-                        int index=rNG->Integer(popVectorSize);
-                        spinFlips.push_back(popVector.at(index));
-                        popVector.erase(popVector.begin()+index);
-                        popVectorSize--;
-                    }
-                }
+    // Normalise to sum g = 2^N
+    double maxLogG=-INFINITY;
+    for(size_t e=0; e < logG.size(); e++) if(visited[e]) maxLogG=std::max(maxLogG,logG[e]);
+    double sum=0;
+    for(size_t e=0; e < logG.size(); e++) if(visited[e]) sum += exp(logG[e]-maxLogG);
+    const double logNorm = range.nActive*log(2.) - maxLogG - log(sum);
+
+    dosBondSum.clear();
+    dosMagnetization.clear();
+    dosLogG.clear();
+    dosMagnetized=range.magnetized;
+    for(size_t e=0; e < logG.size(); e++) {
+        if(!visited[e]) continue;
+        dosBondSum.push_back(bondCount[e] > 0 ? bondTotal[e]/bondCount[e] 
+                                              : range.bondMin+(e/nM+0.5)*range.binWidth);
+        dosMagnetization.push_back(range.magnetized ? 2*int(e%nM)-range.nActive : 0);
+        dosLogG.push_back(logG[e]+logNorm);
+    }
 
-                // Save thread info outside of scope
-                // and submit the thread
-                //boost::thread * tThread
-                //    = new boost::thread(&IsingModel::heatBathStep,this,rNG->Uniform(),spinFlips);
-                ///threads.push_back(tThread);
-                hybridStep(rNG->Uniform(),spinFlips);
+    if(debug) std::cout<<"\t\t- "<<nWalkers<<" walkers, "<<dosLogG.size()
+                       <<" bins reached"<<std::endl;
+}
 
-                //currentNThreads++;
+
+/* (bool) wangLandauWalk
+ *    | Run a Wang-Landau walker on this model (a replica, see 
+ *    | makeReplica) until ln f falls below the precision of the window.
+ *    | The walker first walks into its window, taking only the flips that
+ *    | do not move the bond sum further away from it. A bin seen for the
+ *    | first time starts at the ln g of the bin it is entered from, and 
+ *    | flatness (every visited bin at 80% of the mean) is checked every 
+ *    | 10 sweeps
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *    | (bool) whether the spins are bit-packed
+ *  I | (wangLandauWindow&) window of bins; gets ln g of its bins
+ *    | (TRandom3*) pointer to random number generator
+ *  O | (bool) false if the window is out of reach
+ */
+template<int P, bool BITS>
+bool IsingModel::wangLandauWalk(wangLandauWindow& window, TRandom3* rNG) {
+    const int nM    = window.magnetized ? window.nActive+1 : 1;
+    const int nBins = (window.last-window.first+1)*nM;
+    auto bondBin=[&](const double bonds) {
+        return std::min(window.nBondBins-1,int(floor((bonds-window.bondMin)/window.binWidth)));
+    };
+    auto distance=[&](const int b) {
+        return (b < window.first) ? window.first-b : (b > window.last) ? b-window.last : 0;
+    };
+    auto index=[&](const int b, const int mag) {
+        return (b-window.first)*nM + (window.magnetized ? (mag+window.nActive)/2 : 0);
+    };
+    auto randomSpin=[&]() {
+        int i;
+        do i=rNG->Integer(nSpins); while(!isActive(i));
+        return i;
+    };
+
+    // Walk into the window, giving up after 100 sweeps without getting closer
+    int best=distance(bondBin(bondSum));
+    for(int stalled=0; best > 0 && stalled < 100; ) {
+        bool closer=false;
+        for(int n=0; n < window.nActive && best > 0; n++) {
+            int    i  = randomSpin();
+            int    si = spinAt<BITS>(i);
+            double newBonds = bondSum-2*si*getNeighborSum<P,BITS>(i);
+            int    d  = distance(bondBin(newBonds));
+            if(d > distance(bondBin(bondSum))) continue;
+            flipSpin<BITS>(i);
+            magnetization -= 2*si;
+            bondSum = newBonds;
+            if(d < best) {
+                best=d;
+                closer=true;
             }
+        }
+        stalled = closer ? 0 : stalled+1;
+    }
+    if(best > 0) return false;
+
+    window.logG.assign(nBins,0);
+    window.visited.assign(nBins,0);
+    window.bondTotal.assign(nBins,0);
+    window.bondCount.assign(nBins,0);
+    std::vector<long> histogram(nBins,0);
+    int    current=index(bondBin(bondSum),magnetization);
+    int    nVisited=1;
+    long   nSteps=0;
+    double logF=1;
+    bool   oneOverT=false;
+    window.visited[current]=1;
+    while(logF > window.precision) {
+        for(int n=0; n < 10*window.nActive; n++) {
+            int    i  = randomSpin();
+            int    si = spinAt<BITS>(i);
+            double newBonds = bondSum-2*si*getNeighborSum<P,BITS>(i);
+            int    b  = bondBin(newBonds);
+            if(distance(b) == 0) {
+                int next=index(b,magnetization-2*si);
+                if(!window.visited[next]) {
+                    window.logG[next]=window.logG[current];
+                    window.visited[next]=1;
+                    nVisited++;
+                }
+                double logP=window.logG[current]-window.logG[next];
+                if(logP >= 0 || rNG->Uniform() < exp(logP)) {
+                    flipSpin<BITS>(i);
+                    magnetization -= 2*si;
+                    bondSum = newBonds;
+                    current = next;
+                }
+            }
+            window.logG[current] += logF;
+            histogram[current]++;
+            window.bondTotal[current] += bondSum;
+            window.bondCount[current]++;
+        }
+        nSteps += 10*window.nActive;
 
-            // Let them run in sequence
-            //for(int iThread; iThread<currentNThreads; iThread++) {
-            //    //threads.at(iThread)->join();
-            //}
+        if(oneOverT) {
+            logF=double(nVisited)/nSteps;
+            continue;
+        }
+        long   minCount=LONG_MAX;
+        double meanCount=0;
+        for(int e=0; e < nBins; e++) {
+            if(!window.visited[e]) continue;
+            minCount=std::min(minCount,histogram[e]);
+            meanCount+=histogram[e];
+        }
+        if(minCount >= 0.8*meanCount/nVisited) {
+            logF/=2;
+            histogram.assign(nBins,0);
+            if(logF < double(nVisited)/nSteps) {
+                oneOverT=true;
+                logF=double(nVisited)/nSteps;
+            }
         }
+    }
+    return true;
+}
 
 
-        if(avgAbsDeltaE >= 0) hybridInfo.push_back(avgAbsDeltaE);
-        avgAbsDeltaE=newAvgAbsDeltaE;   
-            
+/* (void) getDensityOfStatesMoments
+ *    | ln Z and the moments of E = -H*M - J*(bond sum) and M from the 
+ *    | density of states. The sums start from the largest weight to stay
+ *    | finite. Without magnetization, <M> and <M^2> are NAN
+ *  I | (double) values of k_B * T, H and J
+ *    | (double*) ln Z, <E>, <E^2>, <M>, <M^2> (output)
+ */
+void IsingModel::getDensityOfStatesMoments(const double tkbT, const double tH,
+                                           const double tJ, double* moments) {
+    if(dosLogG.empty()) {
+        std::cout<<"ERROR: No density of states, see runWangLandau or computeDensityOfStates"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+    if(tH != 0 && !dosMagnetized) {
+        std::cout<<"ERROR: Density of states without magnetization needs H = 0"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+    if(tkbT <= 0) {
+        std::cout<<"ERROR: Temperature must be positive"<<std::endl;
+        exit(EXIT_FAILURE); 
     }
 
-    delete rNG;
+    double maxLogW=-INFINITY;
+    for(size_t b=0; b < dosLogG.size(); b++) {
+        double energy = -tH*dosMagnetization[b] - tJ*dosBondSum[b];
+        maxLogW = std::max(maxLogW,dosLogG[b]-energy/tkbT);
+    }
+    double Z=0, E=0, E2=0, M=0, M2=0;
+    for(size_t b=0; b < dosLogG.size(); b++) {
+        double energy = -tH*dosMagnetization[b] - tJ*dosBondSum[b];
+        double w=exp(dosLogG[b]-energy/tkbT-maxLogW);
+        Z  += w;
+        E  += w*energy;
+        E2 += w*energy*energy;
+        M  += w*dosMagnetization[b];
+        M2 += w*dosMagnetization[b]*dosMagnetization[b];
+    }
+    moments[0] = maxLogW+log(Z);
+    moments[1] = E/Z;
+    moments[2] = E2/Z;
+    moments[3] = dosMagnetized ? M/Z  : NAN;
+    moments[4] = dosMagnetized ? M2/Z : NAN;
+}
+
+
+/* (double) getLogPartitionFunction
+ *    | ln Z from the density of states
+ *  I | (double) value of k_B * T
+ */
+const double IsingModel::getLogPartitionFunction(const double tkbT) {
+    double moments[5];
+    getDensityOfStatesMoments(tkbT,H,J,moments);
+    return moments[0];
+}
+
+
+/* (double) getFreeEnergy
+ *    | F = -k_B T ln Z from the density of states
+ *  I | (double) value of k_B * T
+ */
+const double IsingModel::getFreeEnergy(const double tkbT) {
+    return -tkbT*getLogPartitionFunction(tkbT);
+}
+
+
+/* (double) getInternalEnergy
+ *    | <E> from the density of states
+ *  I | (double) value of k_B * T
+ */
+const double IsingModel::getInternalEnergy(const double tkbT) {
+    double moments[5];
+    getDensityOfStatesMoments(tkbT,H,J,moments);
+    return moments[1];
+}
+
+
+/* (double) getSpecificHeat
+ *    | C = (<E^2> - <E>^2)/(k_B T)^2 from the density of states
+ *  I | (double) value of k_B * T
+ */
+const double IsingModel::getSpecificHeat(const double tkbT) {
+    double moments[5];
+    getDensityOfStatesMoments(tkbT,H,J,moments);
+    return (moments[2]-moments[1]*moments[1])/(tkbT*tkbT);
+}
+
+
+/* (double) getMeanMagnetization
+ *    | <M> from a density of states with magnetization
+ *  I | (double) value of k_B * T
+ */
+const double IsingModel::getMeanMagnetization(const double tkbT) {
+    double moments[5];
+    getDensityOfStatesMoments(tkbT,H,J,moments);
+    return moments[3];
+}
+
+
+/* (double) getSusceptibility
+ *    | chi = (<M^2> - <M>^2)/k_B T from a density of states with 
+ *    | magnetization
+ *  I | (double) value of k_B * T
+ */
+const double IsingModel::getSusceptibility(const double tkbT) {
+    double moments[5];
+    getDensityOfStatesMoments(tkbT,H,J,moments);
+    return (moments[4]-moments[3]*moments[3])/tkbT;
+}
+
+
+/* (void) evaluateDensityOfStates
+ *    | Thermodynamics from the density of states at the points 
+ *    | (kbT_k, H_k, J_k), split across the threads. See getSpecificHeat 
+ *    | and getSusceptibility for C and chi
+ *  I | (vector<double>) values of k_B * T, H and J at each point
+ *    | (vector<double>*) ln Z, <E>, C, <M> and chi at each point (output)
+ */
+void IsingModel::evaluateDensityOfStates(const std::vector<double>& temps,
+                                         const std::vector<double>& fields,
+                                         const std::vector<double>& couplings,
+                                         std::vector<double>* logZ,
+                                         std::vector<double>* meanE,
+                                         std::vector<double>* heat,
+                                         std::vector<double>* meanM,
+                                         std::vector<double>* chi) {
+    const int nPoints=temps.size();
+    if(int(fields.size()) != nPoints || int(couplings.size()) != nPoints) {
+        std::cout<<"ERROR: Need kbT, H and J at every point"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+    logZ ->resize(nPoints);
+    meanE->resize(nPoints);
+    heat ->resize(nPoints);
+    meanM->resize(nPoints);
+    chi  ->resize(nPoints);
+    splitAcrossThreads(nPoints,1,
+        [&](const int chunk, const int first, const int last) {
+            for(int k=first; k < last; k++) {
+                double moments[5];
+                getDensityOfStatesMoments(temps[k],fields[k],couplings[k],moments);
+                (*logZ )[k] = moments[0];
+                (*meanE)[k] = moments[1];
+                (*heat )[k] = (moments[2]-moments[1]*moments[1])/(temps[k]*temps[k]);
+                (*meanM)[k] = moments[3];
+                (*chi  )[k] = (moments[4]-moments[3]*moments[3])/temps[k];
+            }
+        });
+}
+
+
+/* (void) computeDensityOfStates
+ *    | Exact density of states g(bond sum, M) for uniform couplings 
+ *    | (sigma = 0), counting the states of the active spins in Gray code 
+ *    | order as in computeLogPartitionFunction: flipping S_a changes the 
+ *    | number of unsatisfied bonds by S_a*f_a and M by -2*S_a, so each 
+ *    | state costs one neighbor sum and no exp(). With a lattice cache 
+ *    | directory (see setLatticeCache) the result is kept there for each
+ *    | geometry, and read back instead of counted again
+ */
+void IsingModel::computeDensityOfStates() {
+    if(debug) std::cout<<"\tComputeDensityOfStates:"<<std::endl;
+    if(!hasBeenSetup) {
+        std::cout<<"ERROR: Object has not been setup!"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+    if(interactionSigma != 0) {
+        std::cout<<"ERROR: Exact density of states needs sigma = 0"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+
+    std::string path = latticeCacheDir.empty() ? "" : getDensityOfStatesPath();
+    if(!path.empty() && access(path.c_str(),R_OK) == 0) {
+        readDensityOfStates((char*) path.c_str());
+        if(debug) std::cout<<"\t\t- read density of states "<<path<<std::endl;
+        return;
+    }
+
+    std::vector<int   > offsets;
+    std::vector<int   > neighbors;
+    std::vector<double> couplings;
+    const int n       = getEnumerationBonds(offsets,neighbors,couplings);
+    const int upBonds = couplings.size()/2;
+    const int nM      = n+1;
+    if(n > 62) {
+        std::cout<<"ERROR: Exact enumeration needs at most 62 spins"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+
+    int nPrefix=0;
+    while(nPrefix < n && (1L<<nPrefix) < 4L*nThreads) nPrefix++;
+    const int nLow=n-nPrefix;
+
+    // counts[u*(n+1)+(M+n)/2]: states with u unsatisfied bonds and magnetization M
+    std::vector<std::vector<uint64_t> > chunkCounts(nThreads);
+    splitAcrossThreads(1<<nPrefix,1,
+        [&](const int chunk, const int first, const int last) {
+            std::vector<uint64_t>& counts=chunkCounts[chunk];
+            counts.assign((upBonds+1)*nM,0);
+            std::vector<signed char> spins(n);
+            int unsatisfied, mag;
+            auto flip=[&](const int a) {
+                int f=0;
+                for(int e=offsets[a]; e < offsets[a+1]; e++) f += spins[neighbors[e]];
+                unsatisfied += spins[a]*f;
+                mag         -= 2*spins[a];
+                spins[a]     = -spins[a];
+            };
+
+            for(int prefix=first; prefix < last; prefix++) {
+                spins.assign(n,1);
+                unsatisfied=0;
+                mag=n;
+                for(int b=0; b < nPrefix; b++) if((prefix>>b)&1) flip(nLow+b);
+                counts[unsatisfied*nM+(mag+n)/2]++;
+                for(long t=1; t < (1L<<nLow); t++) {
+                    flip(__builtin_ctzl(t));
+                    counts[unsatisfied*nM+(mag+n)/2]++;
+                }
+            }
+        });
+
+    dosBondSum.clear();
+    dosMagnetization.clear();
+    dosLogG.clear();
+    dosMagnetized=true;
+    for(int e=0; e < (upBonds+1)*nM; e++) {
+        uint64_t count=0;
+        for(int c=0; c < nThreads; c++) if(!chunkCounts[c].empty()) count += chunkCounts[c][e];
+        if(count == 0) continue;
+        dosBondSum.push_back(upBonds-2*(e/nM));
+        dosMagnetization.push_back(2*(e%nM)-n);
+        dosLogG.push_back(log(double(count)));
+    }
+    if(debug) std::cout<<"\t\t- "<<dosLogG.size()<<" (bond sum, M) levels"<<std::endl;
+
+    if(!path.empty()) writeDensityOfStates((char*) path.c_str());
+}
+
+
+/* (string) getDensityOfStatesPath
+ *    | File in the lattice cache directory holding the exact density of
+ *    | states for the current lattice and interactions
+ */
+std::string IsingModel::getDensityOfStatesPath() {
+    char name[512];
+    snprintf(name, sizeof(name), "%s/dos_%.10gD_d%i_n%i_%s_%s",
+             latticeCacheDir.c_str(), hausdorffDim, latticeDepth,
+             int(hausdorffSlices), hausdorffMethod.c_str(), interactionRange.c_str());
+    std::string path(name);
+    if(interactionRange=="CUTOFF") {
+        snprintf(name, sizeof(name), "_rc%.10g", cutoffRadius);
+        path += name;
+    }
+    return path+".txt";
+}
+
+
+/* (void) writeDensityOfStates
+ *    | Save the density of states as text: a header line, then one line
+ *    | per bin with the bond sum, magnetization and ln g
+ *  I | (char*) file name
+ */
+void IsingModel::writeDensityOfStates(char* const file) {
+    FILE* f = fopen(file, "w");
+    if(!f) {
+        std::cout<<"WARNING: Could not write density of states "<<file<<std::endl;
+        return;
+    }
+    fprintf(f, "# HausdorffIsingModel density of states: nSpins %i magnetization %i\n",
+            nSpins, int(dosMagnetized));
+    for(size_t b=0; b < dosLogG.size(); b++) 
+        fprintf(f, "%.17g %i %.17g\n", dosBondSum[b], dosMagnetization[b], dosLogG[b]);
+    if(fclose(f) != 0) 
+        std::cout<<"WARNING: Could not write density of states "<<file<<std::endl;
+}
+
+
+/* (void) readDensityOfStates
+ *    | Load a density of states saved by writeDensityOfStates
+ *  I | (char*) file name
+ */
+void IsingModel::readDensityOfStates(char* const file) {
+    FILE* f = fopen(file, "r");
+    if(!f) {
+        std::cout<<"ERROR: Could not read density of states "<<file<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+    int fileSpins, magnetized;
+    if(fscanf(f, "# HausdorffIsingModel density of states: nSpins %i magnetization %i",
+              &fileSpins, &magnetized) != 2) {
+        std::cout<<"ERROR: "<<file<<" is not a density of states"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+    if(hasBeenSetup && fileSpins != nSpins) {
+        std::cout<<"ERROR: "<<file<<" is for a lattice of "<<fileSpins<<" spins"<<std::endl;
+        exit(EXIT_FAILURE); 
+    }
+
+    dosBondSum.clear();
+    dosMagnetization.clear();
+    dosLogG.clear();
+    dosMagnetized=magnetized;
+    double bonds, logG;
+    int    mag;
+    while(fscanf(f, "%lf %i %lf", &bonds, &mag, &logG) == 3) {
+        dosBondSum.push_back(bonds);
+        dosMagnetization.push_back(mag);
+        dosLogG.push_back(logG);
+    }
+    fclose(f);
 }
 
 
 /* (void) metropolisStep 
  *    | Perform one run over the lattice, using Metropolis acceptance function
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *    | (bool) whether the spins are bit-packed
  *  I | (TRandom3*) pointer to random number generator
  */
+template<int P, bool BITS>
 double IsingModel::metropolisStep(TRandom3* rNG) {
 
+    const double h=geth();
+    const double K=getK();
+    updateAcceptanceTables();
+    const double* table = acceptanceTables ? &metropolisTable[maxNeighbors] : 0;
+
     // loop over spins
     for(int i=0; i < nSpins; i++) {
-        double tE = getEffHamiltonian(i);
-        bool spinFlip=false;
-
-        //std::cout<<"\t\t\t-F= "<<currentEffH<<", vs temp: "<<tE<<std::endl;
-
-        if(tE-currentEffH<0) spinFlip = true;
-        else spinFlip = (rNG->Uniform() < exp(currentEffH-tE));
-
-        if(spinFlip) {
-            spinArray.at(i).S=-spinArray.at(i).S;
-            mcInfo.push_back(abs(tE-currentEffH));            
-            currentEffH=tE;
-        }
+        if (!isActive(i)) continue;
+        updateSpin<P,BITS,false>(i,h,K,table,rNG,threadTallies[0]);
     }
+    applyTallies();
 
-    return currentEffH;
+    return getEffHamiltonian();
 }
 
 
 /* (void) heatBathStep 
  *    | Perform one run over the lattice, using the Heat Bath acceptance function
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *    | (bool) whether the spins are bit-packed
  *  I | (TRandom3*) pointer to random number generator
  */
+template<int P, bool BITS>
 double IsingModel::heatBathStep(TRandom3* rNG) {
 
+    const double h=geth();
+    const double K=getK();
+    updateAcceptanceTables();
+    const double* table = acceptanceTables ? &heatBathTable[maxNeighbors] : 0;
+
     // loop over spins
     for(int i=0; i < nSpins; i++) {
-        double tE = getEffHamiltonian(i);
+        if (!isActive(i)) continue;
+        updateSpin<P,BITS,true>(i,h,K,table,rNG,threadTallies[0]);
+    }
+    applyTallies();
+
+    return getEffHamiltonian();
+}
+
+
+/* (void) colorStep 
+ *    | Perform one run over the lattice on all threads. The spins of a 
+ *    | color class (see buildColoring) do not interact, so each class is
+ *    | split across the thread pool and updated at once, one class after
+ *    | the other. Each thread draws from its own random number generator
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *    | (bool) whether the spins are bit-packed
+ *    | (bool) heat bath (true) or Metropolis (false) acceptance
+ *  I | (TRandom3*) pointer to random number generator (unused)
+ */
+template<int P, bool BITS, bool HEATBATH>
+double IsingModel::colorStep(TRandom3* rNG) {
+
+    const double h=geth();
+    const double K=getK();
+    updateAcceptanceTables();
+    const double* table = !acceptanceTables ? 0 
+                        : HEATBATH ? &heatBathTable[maxNeighbors] 
+                                   : &metropolisTable[maxNeighbors];
+
+    // Thread t takes the spins of the class in [start(t), start(t+1)),
+    // on 64-spin boundaries so that no two threads flip bits of the
+    // same word of bit-packed spins
+    auto start=[&](const int t) {return int((long(nSpins)*t/nThreads) & ~63L);};
+
+    for(size_t c=0; c+1 < colorOffsets.size(); c++) {
+        const int* first=&colorSpins[colorOffsets[c]];
+        const int* last =&colorSpins[colorOffsets[c+1]];
+        threadPool->run([&](const int t) {
+            int lo=std::lower_bound(first,last,start(t))-&colorSpins[0];
+            int hi=(t == nThreads-1) ? last-&colorSpins[0] 
+                   : std::lower_bound(first,last,start(t+1))-&colorSpins[0];
+            for(int e=lo; e < hi; e++) {
+                updateSpin<P,BITS,HEATBATH>(colorSpins[e],h,K,table,
+                                            threadRNGs[t],threadTallies[t]);
+            }
+        });
+    }
+    applyTallies();
+
+    return getEffHamiltonian();
+}
+
+
+/* (void) componentStep 
+ *    | Perform one run over the lattice on all threads, when it falls 
+ *    | apart into connected components (see buildComponents). The
+ *    | threads take whole components in turn and sweep each one in index
+ *    | order, as a single thread would, with no wait between color 
+ *    | classes. Each thread draws from its own random number generator
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *    | (bool) whether the spins are bit-packed
+ *    | (bool) heat bath (true) or Metropolis (false) acceptance
+ *  I | (TRandom3*) pointer to random number generator (unused)
+ */
+template<int P, bool BITS, bool HEATBATH>
+double IsingModel::componentStep(TRandom3* rNG) {
+
+    const double h=geth();
+    const double K=getK();
+    updateAcceptanceTables();
+    const double* table = !acceptanceTables ? 0 
+                        : HEATBATH ? &heatBathTable[maxNeighbors] 
+                                   : &metropolisTable[maxNeighbors];
+
+    // Components are handed out a few at a time, enough to balance the 
+    // threads without taking the counter for every small component
+    const int nComponents=getNumComponents();
+    const int grain=std::max(1,nComponents/(16*nThreads));
+    int next=0;
+    threadPool->run([&](const int t) {
+        while(true) {
+            int first=__atomic_fetch_add(&next,grain,__ATOMIC_RELAXED);
+            if(first >= nComponents) break;
+            int last=std::min(nComponents,first+grain);
+            for(int e=componentOffsets[first]; e < componentOffsets[last]; e++) {
+                updateSpin<P,BITS,HEATBATH>(componentSpins[e],h,K,table,
+                                            threadRNGs[t],threadTallies[t]);
+            }
+        }
+    });
+    applyTallies();
 
-        //std::cout<<"\t\t\t-F= "<<currentEffH<<", vs temp: "<<tE<<std::endl;
+    return getEffHamiltonian();
+}
 
-        bool spinFlip=false;
-        double acceptance = exp(currentEffH-tE);
 
-        if(std::isinf(acceptance)) {
-            spinFlip=true;
-        } else if(acceptance > 0) {
-            acceptance/=(exp(tE-currentEffH)+exp(currentEffH-tE));
-            spinFlip = (rNG->Uniform() < acceptance);
+/* (void) buildColoring
+ *    | Sort the active spins into color classes with no bond inside a
+ *    | class, for colorStep. Nearest neighbors differ by one step along
+ *    | one axis, so the parity of the site position is enough; CUTOFF 
+ *    | bonds are colored greedily in index order. LONGRANGE couples all
+ *    | spins and gets no classes
+ */
+void IsingModel::buildColoring() {
+    colorOffsets.clear();
+    colorSpins.clear();
+    if(longRange) return;
+
+    const int p=latticeStrides.size();
+    const int L=latticeAxisPos.size();
+    std::vector<int> color(nSpins,-1);
+    int nColors=0;
+    if(interactionRange=="NEAREST") {
+        nColors=2;
+        for(int i=0; i < nSpins; i++) {
+            if (!isActive(i)) continue;
+            int parity=0;
+            for(int j=0; j < p; j++) parity += (i/latticeStrides[j])%L;
+            color[i]=parity%2;
+        }
+    } else {
+        // usedBy[c] == i if a neighbor of spin i has color c
+        std::vector<int> usedBy;
+        for(int i=0; i < nSpins; i++) {
+            if (!isActive(i)) continue;
+            forEachNeighbor<0>(i,[&](const int j, const double coupling) {
+                if(color[j] >= 0) usedBy[color[j]]=i;
+            });
+            int c=0;
+            while(c < int(usedBy.size()) && usedBy[c] == i) c++;
+            if(c == int(usedBy.size())) usedBy.push_back(-1);
+            color[i]=c;
+            nColors=std::max(nColors,c+1);
         }
+    }
+
+    colorOffsets.assign(nColors+1,0);
+    for(int i=0; i < nSpins; i++) {
+        if(color[i] >= 0) colorOffsets[color[i]+1]++;
+    }
+    for(int c=0; c < nColors; c++) colorOffsets[c+1] += colorOffsets[c];
+    colorSpins.resize(colorOffsets[nColors]);
+    std::vector<int> fill(colorOffsets.begin(),colorOffsets.end()-1);
+    for(int i=0; i < nSpins; i++) {
+        if(color[i] >= 0) colorSpins[fill[color[i]]++]=i;
+    }
+
+    if(debug) std::cout<<"\t\t- "<<nColors<<" color classes"<<std::endl;
+}
 
-        if(spinFlip) {
-            spinArray.at(i).S=-spinArray.at(i).S;
-            mcInfo.push_back(abs(tE-currentEffH));
-            currentEffH=tE;
+
+/* (void) buildComponents
+ *    | Sort the active spins into the connected components of the bonds,
+ *    | each in index order, with a union-find over the bonds. Spins of
+ *    | different components never interact: Z is the product of the Z of
+ *    | the components, and they can be swept on different threads (see 
+ *    | componentStep) if none of them holds more than a thread's share 
+ *    | of the spins. LONGRANGE couples all spins into one component
+ */
+void IsingModel::buildComponents() {
+    componentOffsets.clear();
+    componentSpins.clear();
+    componentSweeps=false;
+
+    // Roots are the smallest index of their tree
+    std::vector<int> parent(nSpins,-1);
+    auto find=[&](int i) {
+        while(parent[i] != i) {
+            parent[i]=parent[parent[i]];
+            i=parent[i];
         }
+        return i;
+    };
+    int first=-1;
+    for(int i=0; i < nSpins; i++) {
+        if (!isActive(i)) continue;
+        parent[i] = (longRange && first >= 0) ? first : i;
+        if(first < 0) first=i;
+    }
+    for(int i=0; i < nSpins && !longRange; i++) {
+        if (!isActive(i)) continue;
+        forEachNeighbor<0>(i,[&](const int j, const double coupling) {
+            if(parent[j] < 0) return;
+            int a=find(i);
+            int b=find(j);
+            if(a < b) parent[b]=a;
+            if(b < a) parent[a]=b;
+        });
+    }
+
+    std::vector<int> component(nSpins,-1);
+    int nComponents=0;
+    for(int i=0; i < nSpins; i++) {
+        if(parent[i] < 0) continue;
+        int root=find(i);
+        if(root == i) component[i]=nComponents++;
+        else          component[i]=component[root];
+    }
+    componentOffsets.assign(nComponents+1,0);
+    for(int i=0; i < nSpins; i++) {
+        if(component[i] >= 0) componentOffsets[component[i]+1]++;
+    }
+    int largest=0;
+    for(int c=0; c < nComponents; c++) {
+        largest=std::max(largest,componentOffsets[c+1]);
+        componentOffsets[c+1] += componentOffsets[c];
+    }
+    componentSpins.resize(componentOffsets[nComponents]);
+    std::vector<int> fill(componentOffsets.begin(),componentOffsets.end()-1);
+    for(int i=0; i < nSpins; i++) {
+        if(component[i] >= 0) componentSpins[fill[component[i]]++]=i;
+    }
+
+    // Bit-packed spins of different components can share a word
+    componentSweeps = threadPool && !bitPackedSpins 
+                      && long(largest)*nThreads <= long(componentSpins.size());
+
+    if(debug) std::cout<<"\t\t- "<<nComponents<<" connected components, largest "
+                       <<largest<<" spins"<<std::endl;
+}
+
+
+/* (void) startThreads
+ *    | Start the thread pool and one random number generator per thread,
+ *    | unless running on a single thread
+ */
+void IsingModel::startThreads() {
+    if(threadPool && threadPool->getNumThreads() == nThreads) return;
+    stopThreads();
+    threadTallies.assign(nThreads,sweepTally());
+    if(nThreads == 1) return;
+
+    // Seed each thread from a fresh master seed, as for the replicas
+    threadPool=new ThreadPool(nThreads);
+    TRandom3* rNG = new TRandom3(0); 
+    for(int t=0; t < nThreads; t++) threadRNGs.push_back(new TRandom3(rNG->Integer(UINT_MAX)+1));
+    delete rNG;
+}
+
+
+/* (void) stopThreads
+ *    | Stop the thread pool and delete the per-thread generators
+ */
+void IsingModel::stopThreads() {
+    delete threadPool;
+    threadPool=0;
+    for(size_t t=0; t < threadRNGs.size(); t++) delete threadRNGs[t];
+    threadRNGs.clear();
+    threadTallies.assign(1,sweepTally());
+}
+
+/* (void) swendsenWangStep
+ *    | Perform one Swendsen-Wang cluster update. Each satisfied bond 
+ *    | (K*coupling*S_i*S_j > 0) is kept with the Fortuin-Kasteleyn 
+ *    | probability 1-exp(-2K*coupling*S_i*S_j), the clusters of kept bonds
+ *    | are labelled by a lock-free union-find on all threads, and each 
+ *    | cluster C is flipped with the heat bath probability for its field
+ *    | term, 1/(1+exp(2h*sum_C S_i))
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *    | (bool) whether the spins are bit-packed
+ *  I | (TRandom3*) pointer to random number generator
+ */
+template<int P, bool BITS>
+double IsingModel::swendsenWangStep(TRandom3* rNG) {
+
+    const double h=geth();
+    const double K=getK();
+    const double oldEffH=getEffHamiltonian();
+    if(int(clusterParent.size()) != nSpins) {
+        clusterParent.resize(nSpins);
+        clusterSpin  .resize(nSpins);
+        clusterFlip  .resize(nSpins);
+    }
+
+    // Percolate the satisfied bonds, each from its lower end, and join
+    // the clusters at their ends. Chunks fall on 64-spin boundaries
+    // for the bit-packed flips below
+    splitAcrossThreads(nSpins,64,
+        [&](const int chunk, const int first, const int last) {
+            for(int i=first; i < last; i++) {
+                clusterParent[i]=i;
+                clusterSpin  [i]=0;
+                clusterFlip  [i]=0;
+            }
+        });
+    splitAcrossThreads(nSpins,64,
+        [&](const int chunk, const int first, const int last) {
+            TRandom3* rng = threadRNGs.empty() ? rNG : threadRNGs[chunk];
+            for(int i=first; i < last; i++) {
+                if (!isActive(i)) continue;
+                int si=spinAt<BITS>(i);
+                forEachNeighbor<P>(i,[&](const int j, const double coupling) {
+                    double bond=K*coupling*si*spinAt<BITS>(j);
+                    if(j > i && bond > 0 && rng->Uniform() < -expm1(-2*bond)) 
+                        joinClusters(i,j);
+                });
+            }
+        });
+    splitAcrossThreads(nSpins,64,
+        [&](const int chunk, const int first, const int last) {
+            for(int i=first; i < last; i++)
+                __atomic_store_n(&clusterParent[i],findCluster(i),__ATOMIC_RELAXED);
+        });
+
+    // Pick the clusters to flip, in order of their roots
+    if(h != 0) {
+        for(int i=0; i < nSpins; i++) 
+            if(isActive(i)) clusterSpin[clusterParent[i]] += spinAt<BITS>(i);
+    }
+    for(int i=0; i < nSpins; i++) {
+        if(clusterParent[i] == i && isActive(i)) 
+            clusterFlip[i] = (rNG->Uniform() < 1/(1+exp(2*h*clusterSpin[i])));
+    }
+
+    splitAcrossThreads(nSpins,64,
+        [&](const int chunk, const int first, const int last) {
+            for(int i=first; i < last; i++) {
+                if(isActive(i) && clusterFlip[clusterParent[i]]) flipSpin<BITS>(i);
+            }
+        });
+
+    recomputeObservables();
+    double newEffH=getEffHamiltonian();
+    mcInfo.push_back(fabs(newEffH-oldEffH));
+    return newEffH;
+}
+
+
+/* (void) wolffStep
+ *    | Perform one Wolff single cluster update. The cluster grows from a
+ *    | random spin over satisfied bonds, each taken with probability 
+ *    | 1-exp(-2K*coupling*S_i*S_j), using an explicit stack. The field acts
+ *    | as a ghost spin: the cluster C is flipped with probability
+ *    | min(1, exp(-2h*sum_C S_i)).
+ *    | The number of clusters per step is fixed: stopping after a set 
+ *    | number of flipped spins would favour the states that follow large
+ *    | clusters
+ *  T | (int) embedding dimension p, or 0 if only known at run time
+ *    | (bool) whether the spins are bit-packed
+ *  I | (TRandom3*) pointer to random number generator
+ */
+template<int P, bool BITS>
+double IsingModel::wolffStep(TRandom3* rNG) {
+
+    const double h=geth();
+    const double K=getK();
+    if(int(flipMask.size()) != nSpins) flipMask.assign(nSpins,0);
+
+    int seed=rNG->Integer(nSpins);
+    if (!isActive(seed)) return getEffHamiltonian();
+
+    // Grow the cluster, marking its spins in flipMask
+    wolffCluster.clear();
+    wolffStack.clear();
+    wolffStack.push_back(seed);
+    wolffCluster.push_back(seed);
+    flipMask[seed]=1;
+    while(!wolffStack.empty()) {
+        int i=wolffStack.back();
+        wolffStack.pop_back();
+        int si=spinAt<BITS>(i);
+        forEachNeighbor<P>(i,[&](const int j, const double coupling) {
+            if(flipMask[j]) return;
+            double bond=K*coupling*si*spinAt<BITS>(j);
+            if(bond > 0 && rNG->Uniform() < -expm1(-2*bond)) {
+                flipMask[j]=1;
+                wolffStack.push_back(j);
+                wolffCluster.push_back(j);
+            }
+        });
+    }
+
+    // Only bonds leaving the cluster change sign
+    int    dMag=0;
+    double dBonds=0;
+    for(size_t c=0; c < wolffCluster.size(); c++) {
+        int i=wolffCluster[c];
+        int si=spinAt<BITS>(i);
+        dMag -= 2*si;
+        forEachNeighbor<P>(i,[&](const int j, const double coupling) {
+            if(!flipMask[j]) dBonds -= 2*coupling*si*spinAt<BITS>(j);
+        });
+    }
+
+    bool clusterFlip = (h*dMag >= 0) || (rNG->Uniform() < exp(h*dMag));
+    for(size_t c=0; c < wolffCluster.size(); c++) {
+        if(clusterFlip) flipSpin<BITS>(wolffCluster[c]);
+        flipMask[wolffCluster[c]]=0;
+    }
+    if(clusterFlip) {
+        magnetization += dMag;
+        bondSum       += dBonds;
+        mcInfo.push_back(fabs(-h*dMag - K*dBonds));
+    }
+
+    return getEffHamiltonian();
+}
+
+
+/* (int) findCluster
+ *    | Root of the cluster of spin i, halving the path on the way. Safe
+ *    | to call while other threads join clusters
+ *  I | (int) index of the spin
+ */
+inline int IsingModel::findCluster(int i) {
+    while(true) {
+        int parent=__atomic_load_n(&clusterParent[i],__ATOMIC_RELAXED);
+        if(parent == i) return i;
+        int grandparent=__atomic_load_n(&clusterParent[parent],__ATOMIC_RELAXED);
+        if(grandparent != parent) 
+            __atomic_compare_exchange_n(&clusterParent[i],&parent,grandparent,
+                                        false,__ATOMIC_RELAXED,__ATOMIC_RELAXED);
+        i=grandparent;
+    }
+}
+
+
+/* (void) joinClusters
+ *    | Merge the clusters of spins i and j without locks: the root with
+ *    | the larger index is pointed at the other one by compare-and-swap,
+ *    | retrying if another thread moved it first. Links always point to
+ *    | smaller indices, so no cycles form
+ *  I | (int) index of the first spin
+ *    | (int) index of the second spin
+ */
+inline void IsingModel::joinClusters(int i, int j) {
+    while(true) {
+        i=findCluster(i);
+        j=findCluster(j);
+        if(i == j) return;
+        if(i < j) std::swap(i,j);
+        int expected=i;
+        if(__atomic_compare_exchange_n(&clusterParent[i],&expected,j,
+                                       false,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) return;
     }
+}
 
 
-    return currentEffH;
+/* (void) updateAcceptanceTables
+ *    | With uniform couplings (sigma = 0) the neighbor sum of a spin is an
+ *    | integer f in [-z,z], z the largest number of neighbors, so a flip
+ *    | is accepted with one of 2(2z+1) probabilities. Tabulate them for 
+ *    | the current h and K, at [z+f] for S_i=-1 and [3z+1+f] for S_i=+1.
+ *    | Other couplings are left to exp() in the sweeps
+ */
+void IsingModel::updateAcceptanceTables() {
+    acceptanceTables = (interactionSigma==0 && !longRange);
+    if(!acceptanceTables) return;
+
+    const double h=geth();
+    const double K=getK();
+    const int    z=maxNeighbors;
+    if(h == tableh && K == tableK && int(metropolisTable.size()) == 2*(2*z+1)) return;
+
+    metropolisTable.resize(2*(2*z+1));
+    heatBathTable.resize(2*(2*z+1));
+    for(int si=-1; si <= 1; si+=2) {
+        for(int f=-z; f <= z; f++) {
+            int index = (si > 0 ? 2*z+1 : 0) + z + f;
+            double dE = 2*si*(h + K*f);
+            metropolisTable[index] = exp(-dE);
+            heatBathTable[index]   = 1/(1+exp(dE));
+        }
+    }
+    tableh=h;
+    tableK=K;
 }
 
+
 /* (void) hybridStep 
  *    | Perform a single group spin flip for the HYBRID MC method
  *  I | (double) a random number between 0 and 1
@@ -575,18 +3860,38 @@ double IsingModel::heatBathStep(TRandom3* rNG) {
  */
 void IsingModel::hybridStep(const double rng, const std::vector<int>& spinFlips) {
 
-    double tE = getEffHamiltonian(spinFlips);
+    // Bonds with one end in the group change sign, those with both
+    // ends in it do not: sum S_i*neighborSum_i over the group counts 
+    // the first once and the second twice
+    if(int(flipMask.size()) != nSpins) flipMask.assign(nSpins,0);
+    for(size_t i=0; i<spinFlips.size(); i++) flipMask[spinFlips[i]]=1;
+
+    int    dMag=0;
+    double dBonds=0;
+    for(size_t i=0; i<spinFlips.size(); i++) {
+        int index=spinFlips[i];
+        if (!isActive(index)) continue;
+        int si=getSpin(index);
+        dMag -= 2*si;
+        forEachNeighbor<0>(index,[&](const int j, const double coupling) {
+            dBonds -= (flipMask[j] ? 0 : 2)*coupling*si*getSpin(j);
+        });
+    }
+    for(size_t i=0; i<spinFlips.size(); i++) flipMask[spinFlips[i]]=0;
+
+    double dE = -geth()*dMag - getK()*dBonds;
     bool spinFlip=false;
 
-    if(tE-currentEffH<0) spinFlip=true;
-    else spinFlip = (rng < exp(currentEffH-tE));
+    if(dE<0) spinFlip=true;
+    else spinFlip = (rng < exp(-dE));
         
     if(spinFlip) {
         for(size_t i=0; i<spinFlips.size(); i++) {
-            spinArray.at(spinFlips.at(i)).S=-spinArray.at(spinFlips.at(i)).S;
+            flipSpin(spinFlips.at(i));
         }
-        mcInfo.push_back(abs(tE-currentEffH));
-        currentEffH=tE;
+        magnetization += dMag;
+        bondSum       += dBonds;
+        mcInfo.push_back(fabs(dE));
     }
 
 }
@@ -598,12 +3903,61 @@ void IsingModel::hybridStep(const double rng, const std::vector<int>& spinFlips)
 void IsingModel::reset() {
     if(debug) std::cout<<"\tReset:"<<std::endl;
     spinArray.clear();
+    spinBits.clear();
+    bondMasks.clear();
+    spinActiveBuf.clear();
+    spinCoordsBuf.clear();
+    nbrOffsetsBuf.clear();
+    nbrIndicesBuf.clear();
+    nbrDistSqBuf.clear();
+    nbrCouplingsBuf.clear();
+    nbrCouplings=0;
+    if(latticeMap) munmap(latticeMap,latticeMapSize);
+    latticeMap=0;
+    latticeMapSize=0;
+    spinActive=0;
+    spinCoords=0;
+    nbrOffsets=0;
+    nbrIndices=0;
+    nbrDistSq=0;
+    nBonds=0;
     hybridInfo.clear();
     mcInfo.clear();
     latticeDimensions.clear();
+    latticeStrides.clear();
+    latticeAxisPos.clear();
+    axisCouplings.clear();
+    cellWidth.clear();
+    cellOffsets.clear();
+    cellAxisOffsets.clear();
+    cellAxisCenter.clear();
+    cellDiameterSq.clear();
+    cellCharge.clear();
+    cellDipole.clear();
+    longRange=false;
+    metropolisTable.clear();
+    heatBathTable.clear();
+    colorOffsets.clear();
+    colorSpins.clear();
+    componentOffsets.clear();
+    componentSpins.clear();
+    componentSweeps=false;
+    clusterParent.clear();
+    clusterSpin.clear();
+    clusterFlip.clear();
+    wolffStack.clear();
+    wolffCluster.clear();
+    clearReplicas();
+    clearRenormalization();
+    multiSpinWords.clear();
+    dosBondSum.clear();
+    dosMagnetization.clear();
+    dosLogG.clear();
+    stopThreads();
 
     magnetization=0;
-    currentEffH=0;
+    bondSum=0;
+    flipMask.clear();
     nSpins=0;
 
     hasBeenSetup=false;
@@ -620,12 +3974,15 @@ void IsingModel::status() {
     std::cout<<"\t\t| Lattice copies:  "<<getHausdorffSlices()   <<std::endl;
     std::cout<<"\t\t| Lattice scaling: "<<getHausdorffScale()    <<std::endl;
     std::cout<<"\t\t| Number of spins: "<<getNumSpins()          <<std::endl;
+    std::cout<<"\t\t| Lattice storage: "<<getLatticeStorage()     <<std::endl;
+    std::cout<<"\t\t| Spin storage:    "<<getSpinStorage()        <<std::endl;
+    std::cout<<"\t\t| Interactions:    "<<getInteractionRange()   <<std::endl;
     std::cout<<"\t\t| MC Method:       "<<getMCMethod()          <<std::endl;
     std::cout<<"\t\t| Number MC steps: "<<getNumMCSteps()        <<std::endl;
     std::cout<<"\t\t| Number threads:  "<<getNumThreads()        <<std::endl;
     std::cout<<"\t\t|                  "<<getNumThreads()        <<std::endl;
     std::cout<<"\t\t| Beta * Hamiltonian: "<<"-1/"<<kbT<<" * "    <<std::endl;
-    std::cout<<"\t\t|                     "<<"("<<J<<"/|r_i-r_j|^"
+    std::cout<<"\t\t|                     "<<"("<<J<<"*|r_i-r_j|^"
                                            <<getInteractionSigma()<<" * S_i*S_j"<<std::endl;
     std::cout<<"\t\t|                     "<<" + "<<H<<"*S_i)"<<std::endl;
 
@@ -635,52 +3992,35 @@ void IsingModel::status() {
 }
 
 
-/* (void) swap (for QUICKSORT)
- *    | Swap two spins in an array
- */
-void IsingModel::swap(spin* a, spin* b) {
-    spin t = *a;
-    *a = *b;
-    *b = t;
-}
-
-
-/* (void) QSPartition (for QUICKSORT)
- *    | Splits the sort into a sort within a small range
+/* (void) splitAcrossThreads
+ *    | Split the index range [0,n) into nThreads contiguous chunks and run
+ *    | the task on each chunk in its own thread. Chunk boundaries fall on
+ *    | multiples of grain; spare threads get empty chunks
+ *  I | (int) size of the index range
+ *    | (int) granularity of the chunk boundaries
+ *    | (function) task(chunk, first, last) over indices [first,last)
  */
- int IsingModel::QSPartition (std::vector<spin>& vec, int low, int high) {
-    spin pivot = vec[high];
-    int i = (low - 1);
-
-    for (int j = low; j <= high - 1; j++)
-    {
-        if (!(vec[j] > pivot)) {
-            i++;
-            swap(&vec[i], &vec[j]);
-        }
+void IsingModel::splitAcrossThreads(const int n, const int grain,
+        const std::function<void(int,int,int)>& task) {
+    int nGrains   = (n+grain-1)/grain;
+    int perThread = (nGrains+nThreads-1)/nThreads;
+
+    auto runChunk=[&](const int c) {
+        int first = std::min(n,int(std::min<long>(n,long(c)*perThread*grain)));
+        int last  = std::min(n,int(std::min<long>(n,long(c+1)*perThread*grain)));
+        task(c,first,last);
+    };
+    if(threadPool) {
+        threadPool->run(runChunk);
+        return;
     }
-    swap(&vec[i + 1], &vec[high]);
-    return (i + 1);
-}
-
 
-/* (void) QuickSort
- *    | Tail-recursive quick sorting. Must be used, as other sorting methods
- *    | are either too slow or cause a stack overflow.
- */
-void IsingModel::QuickSort(std::vector<spin>& vec, int left, int right) {
-    while (left < right)
-    {
-        int pi = QSPartition(vec, left, right);
-
-        if (pi - left < right - pi) {
-            QuickSort(vec, left, pi - 1);
-            left = pi + 1; 
-        } else {
-            QuickSort(vec, pi + 1, right);
-            right = pi - 1;
-        }
+    std::vector<std::thread> threads;
+    for(int c=0; c < nThreads; c++) {
+        if(c == nThreads-1) runChunk(c);
+        else threads.push_back(std::thread(runChunk,c));
     }
+    for(size_t t=0; t < threads.size(); t++) threads[t].join();
 }
 
 
@@ -691,13 +4031,16 @@ void IsingModel::randomizeSpins() {
     TRandom3 *rNG = new TRandom3(0);
     int nFlips=0;
 
-    for(int i=0; i < spinArray.size(); i++) {
+    for(int i=0; i < nSpins; i++) {
         if(rNG->Uniform() < 0.5) {
-          spinArray.at(i).S = spinArray.at(i).S * -1;
+          flipSpin(i);
           nFlips++;
         }
     }
 
+    recomputeObservables();
+    clearReplicas();
+
     if(debug) std::cout<<"\tRandomizeSpins:\n\t\t- flipped "
                        <<nFlips<<"/"<<nSpins<<std::endl;
 
@@ -711,9 +4054,11 @@ void IsingModel::randomizeSpins() {
  */
 void IsingModel::setAllSpins(const int direction) {
     int allSpin = (direction > 0) ? 1: -1;
-    for(int i=0; i<spinArray.size(); i++) {
-        spinArray.at(i).S=allSpin;
+    for(int i=0; i<nSpins; i++) {
+        if(getSpin(i) != allSpin) flipSpin(i);
     }
+    recomputeObservables();
+    clearReplicas();
 }
 
 /* (TGraph*) getConvergenceGr
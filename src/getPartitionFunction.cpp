@@ -47,6 +47,11 @@ void getPartitionFunction(Double_t HDIM,
     Double_t thausdorffDim     =0;
     Double_t teffHInit         =0;
     Double_t tZ                =0; 
+    Double_t tlnZ              =0; 
+    Double_t tE                =0; 
+    Double_t tC                =0; 
+    Double_t tM                =0; 
+    Double_t tchi              =0; 
     Double_t th                =0;
     Double_t tJ                =0;
     Double_t tsig              =0;
@@ -55,6 +60,11 @@ void getPartitionFunction(Double_t HDIM,
     outTree->Branch("m_o",      &tmagInit);
     outTree->Branch("Ham_o",    &teffHInit);
     outTree->Branch("Z",        &tZ);
+    outTree->Branch("lnZ",      &tlnZ);
+    outTree->Branch("E",        &tE);
+    outTree->Branch("C",        &tC);
+    outTree->Branch("M",        &tM);
+    outTree->Branch("chi",      &tchi);
 
     outTree->Branch("h",        &th);
     outTree->Branch("J",        &tJ);
@@ -92,8 +102,9 @@ void getPartitionFunction(Double_t HDIM,
         tmagInit =model.getMagnetization();
         teffHInit=model.getEffHamiltonian();
         getTimeDelta();
-    tZ=model.getZ();
-    std::cout<<"\t\t- Partition function is "<<tZ<<std::endl;
+    tlnZ=model.computeEliminationLogPartitionFunction(&tE,&tC,&tM,&tchi);
+    tZ=exp(tlnZ);
+    std::cout<<"\t\t- Partition function is "<<tZ<<" (ln Z = "<<tlnZ<<")"<<std::endl;
         getTimeDelta();
     model.status();
         getTimeDelta();
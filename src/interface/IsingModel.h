@@ -8,14 +8,27 @@
  *  - Multithreaded Monte Carlo steps                                          *
  *                                                                             *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-//#include <boost/thread/thread.hpp>
 #include <cstdlib>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <algorithm>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <thread>
 #include <vector>
 #include <iostream>
 #include <cmath>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "TRandom3.h"
 #include "TGraph.h"
+#include "ThreadPool.h"
 
 class IsingModel {
     public :
@@ -32,16 +45,37 @@ class IsingModel {
         void setHausdorffMethod   (char* const  hmtd);
         void setMCMethod          (char* const  mcmd);
         void setInteractionSigma  (const double sig );   
+        void setInteractionRange  (char* const  rng );
+        void setCutoffRadius      (const double rc  );
+        void setOpeningAngle      (const double theta);
+        void setLatticeStorage    (char* const  stor);
+        void setSpinStorage       (char* const  stor);
+        void setLatticeCache      (char* const  dir );
         void setTemperature       (const double tkbT);
         void setCouplingConsts    (const double H,
                                    const double J); 
+        void setTemperatureLadder (const std::vector<double>& temps);
+        void setSwapInterval      (const int num    );
+        void setWangLandauPrecision(const double lnf);
+        void setWangLandauBins    (const int num    );
+        void setWangLandauMagnetization(const bool mag);
 
         const std::vector<int> getSpinArray();
         const std::vector<int> getLatticeDimensions();
+        const std::vector<int> getComponentSizes();
+        const std::vector<int> getComponentSpins(const int c);
+        const int              getNumComponents() 
+                                    {return componentOffsets.empty() ? 0 : componentOffsets.size()-1;}
         const std::string      getHausdorffMethod() 
                                     {return hausdorffMethod ;}
         const std::string      getMCMethod() 
                                     {return mcMethod;}
+        const std::string      getLatticeStorage() 
+                                    {return latticeStorage;}
+        const std::string      getSpinStorage() 
+                                    {return spinStorage;}
+        const std::string      getInteractionRange() 
+                                    {return interactionRange;}
         const int    getNumThreads()         {return nThreads        ;}
         const int    getNumSpins()           {return nSpins          ;}
         const int    getLatticeDepth()       {return latticeDepth    ;}
@@ -49,17 +83,72 @@ class IsingModel {
         const double getHausdorffSlices()    {return hausdorffSlices ;}
         const double getHausdorffScale()     {return hausdorffScale  ;}
         const double getInteractionSigma()   {return interactionSigma;}   
+        const double getCutoffRadius()       {return cutoffRadius    ;}
+        const double getOpeningAngle()       {return openingAngle    ;}
         const double getNumMCSteps()         {return nMCSteps        ;}
         const std::vector<double> getMCInfo(){return mcInfo          ;}
         const std::vector<double> getHybridInfo(){return hybridInfo  ;}
+        const std::vector<double> getTemperatureLadder(){return ladderkbT;}
+        const int    getSwapInterval()       {return swapInterval    ;}
         
         // Observables
         const int    getMagnetization();
         const double getEffHamiltonian(const std::vector<int>& flips=std::vector<int>());
         const double getEffHamiltonian(const int flip);
-        const double computePartitionFunction(
-                const int start=0,
-                const std::vector<int>& flips=std::vector<int>());
+        void         recomputeObservables();
+        const double computePartitionFunction();
+        const double computeLogPartitionFunction();
+        const double computeEliminationLogPartitionFunction(double* meanE=0, double* heat=0,
+                                                            double* meanM=0, double* chi=0);
+        void         computeDensityOfStates();
+
+        // Observables of runParallelTempering, one per ladder temperature
+        // (swap acceptance: between temperatures k and k+1)
+        const std::vector<double> getLadderMagnetization()   {return ladderMag   ;}
+        const std::vector<double> getLadderAbsMagnetization(){return ladderAbsMag;}
+        const std::vector<double> getLadderEffHamiltonian()  {return ladderEffH  ;}
+        const std::vector<double> getSwapAcceptance()        {return swapAcceptance;}
+
+        // Observables of runMultiSpinMonteCarlo, one per replica
+        const std::vector<int>    getMultiSpinMagnetizations();
+        const std::vector<double> getMultiSpinEffHamiltonians();
+        const std::vector<int>    getMultiSpinArray(const int replica);
+
+        // Thermodynamics from the density of states (see runWangLandau,
+        // computeDensityOfStates) at any temperature, with the current H
+        // and J, or at many (kbT, H, J) at once
+        const double getLogPartitionFunction(const double tkbT);
+        const double getFreeEnergy          (const double tkbT);
+        const double getInternalEnergy      (const double tkbT);
+        const double getSpecificHeat        (const double tkbT);
+        const double getMeanMagnetization   (const double tkbT);
+        const double getSusceptibility      (const double tkbT);
+        void         evaluateDensityOfStates(const std::vector<double>& temps,
+                                             const std::vector<double>& fields,
+                                             const std::vector<double>& couplings,
+                                             std::vector<double>* logZ,
+                                             std::vector<double>* meanE,
+                                             std::vector<double>* heat,
+                                             std::vector<double>* meanM,
+                                             std::vector<double>* chi);
+        void         writeDensityOfStates   (char* const file);
+        void         readDensityOfStates    (char* const file);
+
+        // Real-space renormalization by decimation of the depth-1 block
+        // (see renormalizeCouplings), the h=0 fixed point of the flow, the
+        // critical temperature where the flows part, and the correlation 
+        // length exponent nu at the fixed point
+        void         renormalizeCouplings   (const double tK, const double tKGap, 
+                                             const double th, double* K1, 
+                                             double* KGap1, double* h1);
+        void         getRenormalizationFlow (const double tK, const double th, 
+                                             const int nSteps,
+                                             std::vector<double>* flowK,
+                                             std::vector<double>* flowKGap,
+                                             std::vector<double>* flowh);
+        const double getRenormalizationFixedPoint();
+        const double getRenormalizationCriticalTemperature();
+        const double getRenormalizationCorrelationExponent();
 
         // Shorthand definitions
         const double getJ()  {return J                         ;}
@@ -75,6 +164,9 @@ class IsingModel {
         void reset();
         void status();
         void runMonteCarlo();
+        void runParallelTempering();
+        void runMultiSpinMonteCarlo();
+        void runWangLandau();
         void randomizeSpins();
         void setAllSpins(const int direction=1);
 
@@ -82,41 +174,105 @@ class IsingModel {
         TGraph* getConvergenceGr();
 
     private :
-        // Spins
-        struct spin {
-           int S;
-           bool active;
-           std::vector<double> coords;
-           bool operator < (const spin& ts) const {
-                for(int iS=0; iS < coords.size(); iS++) {
-                    if(coords.at(iS) < ts.coords.at(iS)) return true;
-                    else if(coords.at(iS) > ts.coords.at(iS)) return false;
-                    else continue;
-                }
-                return false;
-            }
-           bool operator <= (const spin& ts) const {
-                return !(*this > ts);
-            }
-           bool operator > (const spin& ts) const {
-                for(int iS=0; iS < coords.size(); iS++) {
-                    if(coords.at(iS) > ts.coords.at(iS)) return true;
-                    else if(coords.at(iS) < ts.coords.at(iS)) return false;
-                    else continue;
-                }
-                return false;
-           }
-           bool operator >= (const spin& ts) const {
-                return !(*this < ts);
-           }
-        };
-
-        typedef struct spin spin;
-        
         // Settings
         bool   debug=false;
-        std::vector<spin> spinArray;
+        // Spins, stored as structure of arrays:
+        //  - spinArray:  S_i = +1 or -1
+        //  - spinActive: whether site i takes part in the model
+        //  - spinCoords: p coordinates of site i at [i*p, (i+1)*p)
+        // The geometry arrays point either into the *Buf vectors
+        // or into a mapped lattice cache file
+        std::vector<signed char> spinArray;
+        const char*   spinActive=0;
+        const double* spinCoords=0;
+        std::vector<char  > spinActiveBuf;
+        std::vector<double> spinCoordsBuf;
         std::vector<int > latticeDimensions;
+        std::vector<int > latticeStrides;    // index offset of a step along each axis
+        std::vector<double> latticeAxisPos;  // coordinate of each position along an axis
+        bool   isActive(const int i) {return !spinActive || spinActive[i];}
+        bool   allSpinsActive=true;
+
+        // Bit-packed spins: bit i%64 of spinBits[i/64] is set for S_i = +1
+        bool   bitPackedSpins=false;
+        std::vector<uint64_t> spinBits;
+        std::vector<uint64_t> bondMasks;   // sites with a neighbor up axis j, see packSpins
+        std::string spinStorage="BYTE";
+        // colorStep gives each word to a single thread, but others read
+        // it for neighboring spins: words are loaded and stored atomically
+        template<bool BITS> int  spinAt(const int i) {
+            return BITS ? (((__atomic_load_n(&spinBits[i>>6],__ATOMIC_RELAXED)>>(i&63))&1) ? 1 : -1) 
+                        : spinArray[i];
+        }
+        template<bool BITS> void flipSpin(const int i) {
+            if(BITS) __atomic_store_n(&spinBits[i>>6],
+                                      __atomic_load_n(&spinBits[i>>6],__ATOMIC_RELAXED)^(1ULL<<(i&63)),
+                                      __ATOMIC_RELAXED);
+            else     spinArray[i] = -spinArray[i];
+        }
+        int    getSpin (const int i) {return bitPackedSpins ? spinAt<true>(i) : spinAt<false>(i);}
+        void   flipSpin(const int i) {bitPackedSpins ? flipSpin<true>(i) : flipSpin<false>(i);}
+        void   packSpins();
+        void   buildBondMasks();
+        uint64_t getSpinWord(const long bit);
+        void   countBitPackedSpins();
+
+        // Implicit lattice: spins only, see forEachNeighbor
+        bool   implicitLattice=false;
+        std::vector<double> axisCouplings;   // coupling of positions r, r+1 along an axis
+        std::string latticeStorage="EXPLICIT";
+
+        // CSR neighbor table, see buildNeighborTable
+        const int*    nbrOffsets=0;
+        const int*    nbrIndices=0;
+        const double* nbrDistSq=0;
+        std::vector<int > nbrOffsetsBuf;
+        std::vector<int > nbrIndicesBuf;
+        std::vector<double> nbrDistSqBuf;
+        const double* nbrCouplings=0;         // shared by the replicas of runParallelTempering
+        std::vector<double> nbrCouplingsBuf;
+        int    nBonds=0;
+
+        // Cell tree for LONGRANGE couplings, see buildCellTree. Cells of
+        // level k are at [cellOffsets[k], cellOffsets[k+1]) in cellCharge
+        // (total spin) and, times p, in cellDipole (dipole moment)
+        bool   longRange=false;
+        std::string interactionRange="NEAREST";
+        double openingAngle=0.5;
+        std::vector<int   > cellWidth;       // positions along an axis in a level k cell
+        std::vector<int   > cellOffsets;
+        std::vector<int   > cellAxisOffsets; // level k in cellAxisCenter
+        std::vector<double> cellAxisCenter;  // center of each block of positions
+        std::vector<double> cellDiameterSq;
+        std::vector<double> cellCharge;
+        std::vector<double> cellDipole;
+        void   buildCellTree();
+        void   computeMultipoles();
+        void   updateMultipoles(const int i, const int dS);
+        template<int P, bool BITS> double getLongRangeSum(const int i);
+        template<int P, bool BITS> double getPairSum(const int i);
+        template<int P, bool BITS> 
+        double getCellSum(const int i, const int* r, const double* x,
+                          const int k, const int cell);
+
+        // Lattice cache file, see writeLatticeCache
+        struct latticeCacheHeader {
+            char   magic[8];
+            int    version;
+            int    p;
+            int    depth;
+            int    slices;
+            double dim;
+            double scale;
+            int    nSpins;
+            int    nBonds;
+            char   method[16];
+        };
+        static constexpr const char* latticeCacheMagic="HISINGLC";
+        static const int latticeCacheVersion=1;
+        std::string latticeCacheDir="";
+        void*  latticeMap=0;
+        size_t latticeMapSize=0;
         int    latticeDepth=1;
         int    nThreads=1;
         int    nSpins=0;
@@ -132,28 +288,187 @@ class IsingModel {
         double kbT=1;
         double H=1;
         double J=1;
-        double currentEffH=0;
 
-        // Observables
-        int magnetization = 0;
+        // Observables, updated on every spin flip:
+        //  - magnetization: sum of S_i
+        //  - bondSum:       sum over bonds of coupling*S_i*S_j
+        // so that the effective energy is -h*magnetization - K*bondSum
+        int    magnetization = 0;
+        double bondSum = 0;
         
         // Simulation
-        double xmax=1; // Necessary for nearest-neighbor sum
-        double xmin=0; // Same as above, see getEffHamiltonian definition
         bool   hasBeenSetup=false;
-        double metropolisStep(TRandom3* rNG);
-        double heatBathStep(TRandom3* rNG);
+        template<int P, bool BITS> double metropolisStep(TRandom3* rNG);
+        template<int P, bool BITS> double heatBathStep(TRandom3* rNG);
+        template<int P, bool BITS> double getDeltaEffH(const int i);
+        template<int P, bool BITS> double getNeighborSum(const int i);
+
+        // Parallel sweeps, see colorStep. Each thread tallies the change
+        // of the observables in its own sweepTally, padded against
+        // false sharing
+        struct sweepTally {
+            int    dMag=0;
+            double dBonds=0;
+            std::vector<double> info;
+            char   pad[64];
+        };
+        ThreadPool* threadPool=0;
+        std::vector<TRandom3*>  threadRNGs;
+        std::vector<sweepTally> threadTallies=std::vector<sweepTally>(1);
+        std::vector<int> colorOffsets;       // color class c is colorSpins[colorOffsets[c] ...]
+        std::vector<int> colorSpins;
+        void   startThreads();
+        void   stopThreads();
+        void   buildColoring();
+        void   applyTallies();
+        template<int P, bool BITS, bool HEATBATH> 
+        void   updateSpin(const int i, const double h, const double K,
+                          const double* table, TRandom3* rNG, sweepTally& tally);
+        template<int P, bool BITS, bool HEATBATH> double colorStep(TRandom3* rNG);
+
+        // Connected components of the bonds, see buildComponents. Spins of
+        // different components never interact
+        std::vector<int> componentOffsets;   // component c is componentSpins[componentOffsets[c] ...]
+        std::vector<int> componentSpins;
+        bool   componentSweeps=false;
+        void   buildComponents();
+        void   getComponentClasses(std::vector<int>& classes, std::vector<int>& multiplicity);
+        template<int P, bool BITS, bool HEATBATH> double componentStep(TRandom3* rNG);
+
+        // Cluster updates, see swendsenWangStep
+        std::vector<int   > clusterParent;   // union-find forest of the clusters
+        std::vector<double> clusterSpin;     // sum of the spins of a cluster, at its root
+        std::vector<char  > clusterFlip;
+        int    findCluster(int i);
+        void   joinClusters(int i, int j);
+        template<int P, bool BITS> double swendsenWangStep(TRandom3* rNG);
+        double (IsingModel::*swendsenWangKernel)(TRandom3* rNG)=0;
+        std::vector<int   > wolffStack;      // spins of the cluster left to grow from
+        std::vector<int   > wolffCluster;
+        template<int P, bool BITS> double wolffStep(TRandom3* rNG);
+        double (IsingModel::*wolffKernel)(TRandom3* rNG)=0;
+        std::vector<char> flipMask;
+
+        // Parallel tempering, see runParallelTempering. The replicas are
+        // models that point at the geometry of this one and own only 
+        // their spins
+        std::vector<double> ladderkbT;
+        int    swapInterval=1;
+        std::vector<IsingModel*> replicas;
+        std::vector<double> ladderMag;
+        std::vector<double> ladderAbsMag;
+        std::vector<double> ladderEffH;
+        std::vector<double> swapAcceptance;
+        IsingModel* makeReplica(const double tkbT);
+        void   clearReplicas();
+        double replicaStep(IsingModel* replica, TRandom3* rNG);
+
+        // Renormalization: the depth-1 block and the chain along its edge
+        // with the end spins listed last, which of its bonds cross gaps,
+        // and the decimations done so far by (K, K across gaps, h)
+        IsingModel* rgBlock=0;
+        std::vector<int   > rgOffsets;
+        std::vector<int   > rgNeighbors;
+        std::vector<double> rgCouplings;
+        std::vector<char  > rgGapBonds;
+        std::map<std::vector<double>,std::vector<double> > rgTable;
+        double rgChainsPerEdge=0;
+        double rgRigidGap=0;
+        bool   rgFixedPointKnown=false;
+        double rgFixedPoint=0;
+        bool   rgCriticalKnown=false;
+        double rgCritical=0;
+        void   buildRenormalizationBlock();
+        void   clearRenormalization();
+
+        // Multi-spin coding, see runMultiSpinMonteCarlo: bit r of 
+        // multiSpinWords[i] is set for S_i = +1 in replica r
+        std::vector<uint64_t> multiSpinWords;
+        template<int P> void multiSpinStep(TRandom3* rNG);
+        template<int P> 
+        void   updateMultiSpinWord(const int i, const double* table, TRandom3* rNG);
+        void   (IsingModel::*multiSpinKernel)(TRandom3* rNG)=0;
+
+        // Density of states: ln g of the (bond sum, magnetization) bins
+        // that are reached, see runWangLandau and computeDensityOfStates. Without dosMagnetized the
+        // magnetization is summed over and left at 0
+        std::vector<double> dosBondSum;
+        std::vector<int   > dosMagnetization;
+        std::vector<double> dosLogG;
+        bool   dosMagnetized=false;
+        void   getDensityOfStatesMoments(const double tkbT, const double tH,
+                                         const double tJ, double* moments);
+        std::string getDensityOfStatesPath();
+        static const int maxEliminationWidth=24;
+        int    getEnumerationBonds(std::vector<int>& offsets, std::vector<int>& neighbors,
+                                   std::vector<double>& couplings, const int component=-1);
+        double enumerateLogPartitionFunction(const std::vector<int>& offsets,
+                                             const std::vector<int>& neighbors,
+                                             const std::vector<double>& couplings);
+        double eliminateLogPartitionFunction(const std::vector<int>& offsets,
+                                             const std::vector<int>& neighbors,
+                                             const std::vector<double>& couplings,
+                                             double* derivatives, const int nKept=0,
+                                             std::vector<double>* keptTable=0);
+
+        // Wang-Landau walkers, one per window of bond sum bins. Bin b holds
+        // bond sums [bondMin+b*binWidth, bondMin+(b+1)*binWidth); with 
+        // magnetization, the bin of (b, M) is b*(nActive+1)+(M+nActive)/2
+        struct wangLandauWindow {
+            int    first;               // bond sum bins [first, last]
+            int    last;
+            int    nBondBins;
+            double bondMin;
+            double binWidth;
+            int    nActive;
+            bool   magnetized;
+            double precision;
+            std::vector<double> logG;   // bins of the window, from first
+            std::vector<char  > visited;
+            std::vector<double> bondTotal; // sum of the bond sums seen in a bin
+            std::vector<long  > bondCount;
+        };
+        double wangLandauPrecision=1e-6;
+        int    wangLandauBins=0;
+        bool   wangLandauMagnetization=false;
+        template<int P, bool BITS> 
+        bool   wangLandauWalk(wangLandauWindow& window, TRandom3* rNG);
+        bool   (IsingModel::*wangLandauKernel)(wangLandauWindow& window, TRandom3* rNG)=0;
+
+        // Acceptance of a flip for uniform couplings, see updateAcceptanceTables
+        bool   acceptanceTables=false;
+        int    maxNeighbors=0;
+        double tableh=0;
+        double tableK=0;
+        std::vector<double> metropolisTable;
+        std::vector<double> heatBathTable;
+        void   updateAcceptanceTables();
+        double (IsingModel::*metropolisKernel)(TRandom3* rNG)=0;
+        double (IsingModel::*heatBathKernel  )(TRandom3* rNG)=0;
         void   hybridStep(const double rng, const std::vector<int>& spinFlips);
-        double getDistanceSq(const spin i1, const spin i2);
-        void   nextPermutation(std::vector<int>& tvN, const int max);
+        double getDistanceSq(const int i1, const int i2);
+        template<int P> void buildNeighborTable();
+        template<int P> void buildCutoffTable();
+        double cutoffRadius=0.1;
+        void   computeAxisPositions(const int depth, const double delta);
+        template<int P, typename F>
+        void   forEachNeighbor(const int i, F f);
+        void   computeCouplings();
+        std::string getLatticeCachePath();
+        void   getLatticeCacheLayout(const latticeCacheHeader& hdr,
+                                     size_t* sizes, size_t* offsets);
+        bool   loadLatticeCache();
+        void   writeLatticeCache();
+        void   splitAcrossThreads(const int n, const int grain,
+                        const std::function<void(int,int,int)>& task);
+        template<int P> void selectKernels();
+        template<int P>
+        void   setupLattice(const std::vector<double>& x0,
+                            const std::vector<double>& x1);
+        template<int P>
         void   addSpins(const int depth, 
                         const std::vector<double>& x0, 
                         const std::vector<double>& x1);
         std::vector<double> mcInfo;
         std::vector<double> hybridInfo;
-         
-        // C++ utils
-        void swap(spin *a, spin *b);
-        void QuickSort(std::vector<spin>& vec, int left, int right);
-        int QSPartition(std::vector<spin>& vec, int left, int right);
 };
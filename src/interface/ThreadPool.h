@@ -0,0 +1,92 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * ThreadPool.h                                                                *
+ * Author: Evan Coleman and Brad Marston, 2016                                 *
+ *                                                                             *
+ * Persistent worker threads for the parallel Monte Carlo sweeps. Key          *
+ * characteristics:                                                            *
+ *  - Threads are started once and sleep between tasks                         *
+ *  - run(task) calls task(t) for every thread t and returns when all are done *
+ *  - The calling thread does the work of thread 0                             *
+ *                                                                             *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+    public :
+        // Constructor, destructor
+        ThreadPool(const int num) : nThreads(num) {
+            for(int t=1; t < nThreads; t++)
+                workers.push_back(std::thread(&ThreadPool::work,this,t));
+        }
+        virtual ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping=true;
+            }
+            wake.notify_all();
+            for(size_t t=0; t < workers.size(); t++) workers[t].join();
+        }
+
+        int getNumThreads() const {return nThreads;}
+
+        /* (void) run
+         *    | Call task(t) on each thread t = 0 ... nThreads-1, and wait
+         *    | for all of them to finish
+         *  I | (function) task(thread index)
+         */
+        void run(const std::function<void(int)>& task) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                currentTask=&task;
+                nBusy=nThreads-1;
+                generation++;
+            }
+            wake.notify_all();
+
+            task(0);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock,[&]{return nBusy == 0;});
+            currentTask=0;
+        }
+
+    private :
+        int  nThreads;
+        int  nBusy=0;
+        long generation=0;
+        bool stopping=false;
+        const std::function<void(int)>* currentTask=0;
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable finished;
+
+        // Worker loop: wait for a new generation of work, run it, report
+        void work(const int t) {
+            long seen=0;
+            while(true) {
+                const std::function<void(int)>* task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock,[&]{return stopping || generation != seen;});
+                    if(stopping) return;
+                    seen=generation;
+                    task=currentTask;
+                }
+
+                (*task)(t);
+
+                std::lock_guard<std::mutex> lock(mutex);
+                if(--nBusy == 0) finished.notify_one();
+            }
+        }
+};
+
+#endif
@@ -90,6 +90,10 @@ void runIsingModel(Double_t HDIM,
     model.setInteractionSigma  (SIGMA);   
     model.setTemperature       (KBT);
     model.setCouplingConsts    (COUPLING_H,COUPLING_J); 
+    if(getenv("ISING_LATTICE_CACHE")) 
+        model.setLatticeCache  (getenv("ISING_LATTICE_CACHE"));
+    if(getenv("ISING_INTERACTION_RANGE")) 
+        model.setInteractionRange(getenv("ISING_INTERACTION_RANGE"));
 
     /*
      *  Run the model
@@ -155,6 +155,14 @@ void testIsingModel() {
     model.status();
         getTimeDelta();
 
+    double runningEffH=model.getEffHamiltonian();
+    int    runningMag =model.getMagnetization();
+    model.recomputeObservables();
+    niceAssert("Running energy matches a full recount",
+               fabs(runningEffH-model.getEffHamiltonian()) < 1e-9*(1+fabs(runningEffH)));
+    niceAssert("Running magnetization matches a full recount",
+               runningMag == model.getMagnetization());
+
     TGraph *hrbConGr = (TGraph*) model.getConvergenceGr()->Clone("Hybrid");
     hrbConGr->SetTitle("Hybrid");
     hrbConGr->SetMarkerStyle(20);
@@ -164,6 +172,112 @@ void testIsingModel() {
 
 
 
+    // Check the running energy of a long-range run, where the spins see
+    // each other through the cell tree
+    std::cout<<"\n\n***********************************************"<<std::endl;
+    std::cout<<"* Long-range running energy                   *"<<std::endl;
+    std::cout<<"***********************************************"<<std::endl;
+    model.reset();
+    model.setMCMethod("HEATBATH");
+    model.setLatticeDepth(1);
+    model.setInteractionRange("LONGRANGE");
+    model.setInteractionSigma(-1);
+    model.setOpeningAngle(0.5);
+    model.setNumMCSteps(10000);
+    model.setCouplingConsts(0,1);
+    model.setTemperature(20);
+    model.setup();
+    model.randomizeSpins();
+    model.runMonteCarlo();
+        getTimeDelta();
+
+    runningEffH=model.getEffHamiltonian();
+    runningMag =model.getMagnetization();
+    model.recomputeObservables();
+    niceAssert("Long-range running energy matches a full recount",
+               fabs(runningEffH-model.getEffHamiltonian()) < 1e-9*(1+fabs(runningEffH)));
+    niceAssert("Long-range running magnetization matches a full recount",
+               runningMag == model.getMagnetization());
+    model.setInteractionRange("NEAREST");
+    model.setInteractionSigma(0);
+
+
+
+    // Check a parallel tempering run across a temperature ladder on the
+    // ferromagnet, which orders below T_c = 2.27. The 8x8 lattice is 
+    // small enough for neighboring temperatures to swap
+    std::cout<<"\n\n***********************************************"<<std::endl;
+    std::cout<<"* Parallel tempering on the 1.5D lattice      *"<<std::endl;
+    std::cout<<"***********************************************"<<std::endl;
+    model.reset();
+    model.setMCMethod("HEATBATH");
+    model.setLatticeDepth(2);
+    model.setNumMCSteps(1000);
+    model.setCouplingConsts(0,1);
+    model.setup();
+    model.randomizeSpins();
+    std::vector<double> ladder;
+    for(int k=0; k < 8; k++) ladder.push_back(1+0.5*k);
+    model.setTemperatureLadder(ladder);
+        getTimeDelta();
+    model.runParallelTempering();
+        getTimeDelta();
+
+    // <|m|> is noisy above T_c: allow it 5% of the spins of slack.
+    // With H = 0, <beta H> times T is the energy
+    std::vector<double> ladderAbsMag=model.getLadderAbsMagnetization();
+    std::vector<double> ladderEffH=model.getLadderEffHamiltonian();
+    std::vector<double> swapAcceptance=model.getSwapAcceptance();
+    bool magFalls=true;
+    for(size_t k=1; k < ladder.size(); k++) 
+        magFalls &= ladderAbsMag[k] <= ladderAbsMag[k-1] + 0.05*model.getNumSpins();
+    magFalls &= ladderAbsMag.front() > 0.5*model.getNumSpins();
+    bool energyRises=true;
+    for(size_t k=1; k < ladder.size(); k++) 
+        energyRises &= ladderEffH[k]*ladder[k] > ladderEffH[k-1]*ladder[k-1];
+    bool swapsMix=true;
+    for(size_t k=0; k < swapAcceptance.size(); k++) swapsMix &= swapAcceptance[k] > 0;
+    niceAssert("Parallel tempering <|m|> falls along the ladder",magFalls);
+    niceAssert("Parallel tempering <E> rises along the ladder",energyRises);
+    niceAssert("Parallel tempering swaps between all neighbors",swapsMix);
+
+
+
+    // Check exact ln Z by variable elimination against enumeration
+    std::cout<<"\n\n***********************************************"<<std::endl;
+    std::cout<<"* Exact partition function of a small lattice *"<<std::endl;
+    std::cout<<"***********************************************"<<std::endl;
+    model.reset();
+    model.setLatticeDepth(1);
+    model.setCouplingConsts(0.3,1);
+    model.setTemperature(2);
+    model.setup();
+    double enumeratedLogZ=model.computeLogPartitionFunction();
+        getTimeDelta();
+    double eliminatedLogZ=model.computeEliminationLogPartitionFunction();
+        getTimeDelta();
+    niceAssert("Variable elimination matches enumeration",
+               fabs(enumeratedLogZ-eliminatedLogZ) < 1e-9*fabs(enumeratedLogZ));
+
+
+
+    // Check the renormalization flow parts at a finite temperature in 2D
+    // but not in 1D
+    std::cout<<"\n\n***********************************************"<<std::endl;
+    std::cout<<"* Real-space renormalization                  *"<<std::endl;
+    std::cout<<"***********************************************"<<std::endl;
+    double planeTc=model.getRenormalizationCriticalTemperature();
+        getTimeDelta();
+    model.reset();
+    model.setHausdorffDimension(1);
+    model.setup();
+    double lineTc=model.getRenormalizationCriticalTemperature();
+        getTimeDelta();
+    niceAssert("Renormalization finds T_c > 0 in 1.5D",planeTc > 0);
+    niceAssert("Renormalization finds no T_c in 1D",std::isnan(lineTc));
+
+
+
     std::cout<<"\n\n***********************************************"<<std::endl;
     std::cout<<"* Preparing validation plots                  *"<<std::endl;
     std::cout<<"***********************************************"<<std::endl;